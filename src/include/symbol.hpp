@@ -2,13 +2,23 @@
 #include <cmath>
 #include <string>
 #include <vector>
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <cstdint>
+#include <cstdio>
+#include <limits>
 #include <sstream>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <condition_variable>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 
 #include "easylogging++.h"
 
@@ -44,17 +54,55 @@ namespace Symbol {
     enum class Operator;
 
     class Exp;
+
+    class UniqueTable;
+
+    class SymbolTable;
+
+    class ConstantTable;
+
+    class WorkerPool;
+    class Polynomial;
+    class PolynomialStream;
+    class TermRun;
+    class PolynomialRing;
+
+    class Arena;
+
+    template<typename T> class ArenaAllocator;
+
+    template<typename T, size_t N> class SmallVector;
+
+    template<typename T> class Handle;
   };
 
   class Expression;
 
-  typedef std::shared_ptr<Symbol::Impl_::Exp> Operand;
-  typedef std::shared_ptr<Symbol::Impl_::Exp> pExp;
-  typedef std::vector<Operand> Operands;
+  class Context;
+
+  class Budget;
+
+  class FlatExpression;
+
+  class TermStream;
+
+  class ExternalExpansion;
+
+  typedef Symbol::Impl_::Handle<Symbol::Impl_::Exp> Operand;
+  typedef Symbol::Impl_::Handle<Symbol::Impl_::Exp> pExp;
+  typedef Symbol::Impl_::SmallVector<Operand, 2> Operands;
   typedef std::vector<uint32_t> Shape;
 };
 
-#define MAKE_SHARED_EXP std::make_shared<Symbol::Impl_::Exp>
+#define MAKE_SHARED_EXP Symbol::Impl_::makeExp
+
+// Define SYMBOL_NONATOMIC_REFCOUNT when Expressions are used from only one
+// thread, so that copying handles does not need atomic operations.
+#ifdef SYMBOL_NONATOMIC_REFCOUNT
+#define SYMBOL_REFCOUNT_TYPE uint32_t
+#else
+#define SYMBOL_REFCOUNT_TYPE std::atomic<uint32_t>
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 // Operations
@@ -77,6 +125,7 @@ namespace Symbol {
     (std::ostream& o, type* pBuffer, size_t row, size_t col, size_t  channel, bool encloseBracket);
 
     // Support functions for Exp
+    template<typename... Args> pExp makeExp(Args&&... args);
     pExp constructZero();
     pExp constructOne();
     pExp constructCONST(const double c);
@@ -84,12 +133,27 @@ namespace Symbol {
     pExp constructVARIABLE(const std::string name, const double c);
     pExp constructNEGATE(const Operand o);
     pExp constructADD(const Operands ops);
+    pExp constructADD(const Operands ops, const double constant);
     pExp constructMULTIPLY(const Operands ops);
+    pExp constructMULTIPLY(const Operands ops, const double coefficient);
     pExp constructPOWER(const Operands ops);
     pExp constructInverse(const Operand o);
     pExp constructLOG(const Operand o);
+    pExp constructOperation(const Operator oprtr, const Operands ops);
+    pExp constructOperation(const Operator oprtr, const Operands ops, const double coefficient);
+    Operands allOperands(const pExp& e);
+    pExp scaleTerm(const pExp& term, const double coeff);
+    struct OperandChange;
+    void planTerm(const Exp* sum, const pExp& term, std::vector<OperandChange>& changes);
+    void commitChanges(Exp* e, const std::vector<OperandChange>& changes);
+    bool appendTerms(const pExp& sum, const pExp& e);
+    pExp constructPowerOf(const pExp& base, const double numeric, const Operands& symbolic);
+    bool planFactor
+    (const Exp* product, const pExp& factor, double& coeff, std::vector<OperandChange>& changes);
+    bool appendFactors(const pExp& product, const pExp& e, Operands& rest);
 
     pExp simplify(pExp e);
+    pExp simplifyOperands(pExp e);
     pExp flatten(pExp e);
     pExp flattenNEGATE(pExp e);
     pExp flattenMultiOperands(pExp e);
@@ -99,6 +163,11 @@ namespace Symbol {
     pExp expandNEGATE(pExp e);
     pExp expandMULTIPLY(pExp e);
     pExp expandPOWER(pExp e);
+    pExp expandPolynomial(pExp e);
+    double predictTerms(const pExp& e);
+    bool withinBudget(const pExp& e);
+    size_t& refusals();
+    void chargeNode();
     pExp expandLOG(pExp e);
     pExp merge(pExp e);
     pExp mergeADD(pExp e);
@@ -108,10 +177,21 @@ namespace Symbol {
 
     pExp differentiate(pExp dy, Operand dx);
 
-    Operands decompose2(Operand o);
-    Operands decompose3(Operand o);
+    std::string constToStr(const double value, bool encloseBracket);
+
+    struct Decomposed2;
+    struct Decomposed3;
+    Decomposed2 decompose2(const Operand& o);
+    Decomposed3 decompose3(const Operand& o);
 
     struct compareOperands;
+    struct hashOperand;
+    struct equalOperand;
+    struct equalTerm;
+    typedef std::unordered_map<pExp, pExp, hashOperand, equalTerm> TermIndex;
+    int compare(const Exp& e1, const Exp& e2);
+    int compareOperandsOf(const Exp& e1, const Exp& e2);
+    bool isSame(const pExp& e1, const pExp& e2);
 
     pExp operator - (const Operand o);
     pExp operator + (const Operand o1, const Operand o2);
@@ -134,6 +214,12 @@ namespace Symbol {
   bool operator != (const std::string strExp, const Expression &e);
   Expression operator - (const Expression &e);
   Expression operator + (const Expression &e1, const Expression &e2);
+  Expression operator + (Expression &&e1, const Expression &e2);
+  Expression operator - (Expression &&e1, const Expression &e2);
+  Expression operator * (Expression &&e1, const Expression &e2);
+  Expression operator + (Expression &&e, const double c);
+  Expression operator - (Expression &&e, const double c);
+  Expression operator * (Expression &&e, const double c);
   Expression operator + (const Expression &e, const double c);
   Expression operator + (const double c, const Expression &e);
   Expression operator - (const Expression &e1, const Expression &e2);
@@ -152,6 +238,8 @@ namespace Symbol {
   Expression log (const double o);
 
   std::ostream& operator << (std::ostream& o, const Expression &e);
+
+  void enableHashConsing(bool enable=true);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -204,14 +292,208 @@ public:
 };
 
 
+/// Bump allocator for Expression nodes.
+/// Memory is handed out from large chunks and is not reused on deallocation,
+/// except for the most recent allocation. reset() rewinds to the first chunk
+/// in O(1) and keeps the chunks for reuse. Not thread-safe.
+class Symbol::Impl_::Arena {
+  size_t chunkSize_;
+  std::vector<std::unique_ptr<uint8_t[]>> chunks_;
+  std::vector<size_t> chunkSizes_;
+  size_t chunk_;
+  size_t offset_;
+  size_t live_;
+public:
+  explicit Arena(size_t chunkSize);
+
+  // Arena used by ArenaAllocator of the calling thread. NULL if none.
+  static Arena*& current();
+
+  void* allocate(size_t bytes, size_t alignment);
+  void deallocate(void* p, size_t bytes);
+
+  size_t live() const;
+  size_t capacity() const;
+  void reset();
+};
+
+/// Allocator that takes memory from the Arena current at its construction,
+/// or from the global heap when no Arena is active.
+template<typename T>
+class Symbol::Impl_::ArenaAllocator {
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  Arena* arena_;
+
+  ArenaAllocator();
+  template<typename U> ArenaAllocator(const ArenaAllocator<U>& other);
+
+  T* allocate(size_t n);
+  void deallocate(T* p, size_t n);
+};
+
+/// Vector which keeps up to N elements in place and moves them to
+/// ArenaAllocator memory only when it grows further.
+/// Provides the subset of std::vector interface used for Operands.
+template<typename T, size_t N>
+class Symbol::Impl_::SmallVector {
+  T* data_;
+  size_t size_;
+  size_t capacity_;
+  ArenaAllocator<T> allocator_;
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type inline_[N];
+
+  T* inlineData();
+  bool isInline() const;
+  void grow(size_t capacity);
+  void release();
+public:
+  typedef T value_type;
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  SmallVector();
+  SmallVector(std::initializer_list<T> init);
+  SmallVector(const SmallVector& other);
+  SmallVector(SmallVector&& other) noexcept;
+  ~SmallVector();
+
+  SmallVector& operator = (const SmallVector& other);
+  SmallVector& operator = (SmallVector&& other) noexcept;
+
+  iterator begin();
+  iterator end();
+  const_iterator begin() const;
+  const_iterator end() const;
+
+  size_t size() const;
+  bool empty() const;
+  size_t capacity() const;
+
+  T& operator[] (size_t i);
+  const T& operator[] (size_t i) const;
+  T& back();
+  const T& back() const;
+
+  void reserve(size_t capacity);
+  void push_back(const T& value);
+  void push_back(T&& value);
+  void pop_back();
+  void clear();
+  template<typename InputIt> iterator insert(const_iterator pos, InputIt first, InputIt last);
+};
+
+/// Intrusive reference counting pointer.
+/// T provides retain() and release(), the latter destroys T
+/// when the last reference is gone.
+template<typename T>
+class Symbol::Impl_::Handle {
+  T* p_;
+public:
+  Handle() noexcept;
+  Handle(std::nullptr_t) noexcept;
+  explicit Handle(T* p);
+  Handle(const Handle& other);
+  Handle(Handle&& other) noexcept;
+  ~Handle();
+
+  Handle& operator = (const Handle& other);
+  Handle& operator = (Handle&& other) noexcept;
+
+  T* get() const;
+  T& operator * () const;
+  T* operator -> () const;
+  explicit operator bool () const;
+
+  uint32_t use_count() const;
+  void reset();
+};
+
+/// Interns VARIABLE names to compact IDs, so that Exp stores only the ID
+/// and compares variables by integer. Names are never released.
+/// Shared by all threads. intern takes the lock, while name and hash read
+/// without it, as entries never move and an ID is known only after intern
+/// has written its entry.
+class Symbol::Impl_::SymbolTable {
+  struct Entry {
+    std::string name_;
+    uint64_t hash_;
+  };
+  // Chunk k holds FIRST_CHUNK << k entries, enough for every uint32_t ID.
+  static const size_t FIRST_CHUNK = 64;
+  static const size_t MAX_CHUNKS = 26;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, uint32_t> ids_;
+  std::unique_ptr<Entry[]> chunks_[MAX_CHUNKS];
+  uint32_t size_;
+
+  SymbolTable();
+  // Chunk of the ID, and the position in it in offset.
+  static size_t chunkOf(uint32_t id, size_t& offset);
+public:
+  static SymbolTable& instance();
+
+  uint32_t intern(const std::string& name);
+  const std::string& name(uint32_t id) const;
+  uint64_t hash(uint32_t id) const;
+  size_t size() const;
+};
+
+/// Immortal CONST nodes for small integers and halves, shared by every
+/// constructCONST call so that common constants are never allocated.
+/// The nodes are built once outside of any Context and the table keeps
+/// a reference to them until the program exits.
+class Symbol::Impl_::ConstantTable {
+  static const int MIN_INTEGER = -16;
+  static const int MAX_INTEGER = 256;
+
+  std::vector<pExp> integers_;
+  pExp half_;
+  pExp minusHalf_;
+
+  ConstantTable();
+public:
+  static const ConstantTable& instance();
+
+  // Returns null when the value is not cached.
+  const pExp* find(const double value) const;
+};
+
 class Symbol::Impl_::Exp {
 #ifdef TEST_IMPL_
 public:
 #endif
-  std::string name_;
-  std::shared_ptr<double> pVal_;
+  // ID of VARIABLE name in SymbolTable
+  uint32_t symbol_;
+  // Value of CONST, constant term of ADD or coefficient of MULTIPLY
+  double value_;
+  // Value bound to VARIABLE
+  std::shared_ptr<double> pBinding_;
   Operator operator_;
   Operands operands_;
+  uint64_t hash_;
+  // Set on the result of simplify so that it is not simplified again.
+  // Atomic as shared nodes are read and marked by several threads.
+  std::atomic<bool> simplified_;
+  // Set while registered in UniqueTable.
+  bool interned_;
+  // Arena this node was allocated from. NULL for the global heap.
+  Arena* arena_;
+  mutable SYMBOL_REFCOUNT_TYPE refCount_;
+  // Operand holding each term of ADD, or each base of MULTIPLY,
+  // built on the first in-place append. Keys are terms without their
+  // coefficient, or bases without their exponent.
+  std::unique_ptr<TermIndex> terms_;
+
+  void computeHash();
+  static uint64_t mix(uint64_t h);
+  static uint64_t structuralHash(const Operator oprtr, const double value,
+                                 const uint32_t symbol, const Operands& ops);
 public:
   // Constant constructor
   Exp(double value);
@@ -222,6 +504,14 @@ public:
 
   // Operation constructor
   Exp(Operator oprtr, Operands oprnds);
+  Exp(Operator oprtr, Operands oprnds, double coefficient);
+
+  Exp(const Exp&) = delete;
+  Exp& operator = (const Exp&) = delete;
+
+  void retain() const;
+  void release() const;
+  uint32_t useCount() const;
 
   void assertOperationConsistency() const;
 
@@ -230,14 +520,21 @@ public:
   bool isPositive() const;
   bool isZero() const;
   bool isOne() const;
+  bool isSimplified() const;
+  bool hasCoefficient() const;
+
+  static double identity(const Operator oprtr);
 
   std::string toStr(bool encloseBracket=false) const;
   double value() const;
+  uint64_t hash() const;
+  const std::string& name() const;
 
   void assign(double value);
   double evaluate() const;
 
   friend pExp simplify(pExp e);
+  friend pExp simplifyOperands(pExp e);
   friend pExp sort(pExp e);
   friend pExp flatten(pExp e);
   friend pExp flattenNEGATE(pExp e);
@@ -248,18 +545,70 @@ public:
   friend pExp expandMULTIPLY(pExp e);
   friend pExp expandPOWER(pExp e);
   friend pExp expandLOG(pExp e);
+  friend pExp expandPolynomial(pExp e);
+  friend double predictTerms(const pExp& e);
   friend pExp merge(pExp e);
   friend pExp mergeADD(pExp e);
   friend pExp mergeMULTIPLY(pExp e);
   friend pExp mergePOWER(pExp e);
   friend pExp mergeLOG(pExp e);
 
-  friend Operands decompose2(pExp e);
-  friend Operands decompose3(pExp e);
+  friend Decomposed2 decompose2(const Operand& o);
+  friend Decomposed3 decompose3(const Operand& o);
+
+  friend int compare(const Exp& e1, const Exp& e2);
+  friend int compareOperandsOf(const Exp& e1, const Exp& e2);
+  friend Operands allOperands(const pExp& e);
+  friend pExp scaleTerm(const pExp& term, const double coeff);
+  friend bool appendTerms(const pExp& sum, const pExp& e);
+  friend void planTerm(const Exp* sum, const pExp& term, std::vector<OperandChange>& changes);
+  friend void commitChanges(Exp* e, const std::vector<OperandChange>& changes);
+  friend bool planFactor
+  (const Exp* product, const pExp& factor, double& coeff, std::vector<OperandChange>& changes);
+  friend bool appendFactors(const pExp& product, const pExp& e, Operands& rest);
 
   friend pExp differentiate(pExp dy, Operand dx);
 
+  template<typename... Args> friend pExp makeExp(Args&&... args);
+
+  friend UniqueTable;
+  friend ConstantTable;
   friend Expression;
+  friend FlatExpression;
+  friend equalTerm;
+  friend PolynomialRing;
+};
+
+/// Hash-consing table.
+/// When enabled, construct* functions return the existing node for
+/// structurally identical CONST and operation nodes instead of allocating
+/// a new one, so identical subtrees are shared and compare equal by pointer.
+/// Entries do not own the nodes, a node removes itself when it is destroyed.
+/// VARIABLE nodes are never interned as they carry their own value.
+/// Not thread-safe.
+class Symbol::Impl_::UniqueTable {
+  typedef std::vector<Exp*> Bucket;
+
+  bool enabled_;
+  size_t size_;
+  std::unordered_map<size_t, Bucket> buckets_;
+
+  static bool matches(const Exp& e, const Operator oprtr, const double value, const Operands& ops);
+public:
+  UniqueTable();
+  ~UniqueTable();
+
+  static UniqueTable& instance();
+
+  void enable(bool enable=true);
+  bool isEnabled() const;
+  size_t size() const;
+
+  pExp find(const Operator oprtr, const double value, const Operands& ops) const;
+  void insert(const pExp& e);
+  void erase(Exp* e);
+  void sweep();
+  void clear();
 };
 
 class Symbol::Expression {
@@ -277,7 +626,9 @@ public:
 
   friend Expression operator - (const Expression &e);
   friend Expression operator + (const Expression &e1, const Expression &e2);
+  friend Expression operator + (Expression &&e1, const Expression &e2);
   friend Expression operator * (const Expression &e1, const Expression &e2);
+  friend Expression operator * (Expression &&e1, const Expression &e2);
   friend Expression operator ^ (const Expression &e1, const Expression &e2);
   friend Expression operator / (const Expression &e1, const Expression &e2);
   friend Expression log (const Expression &e);
@@ -285,7 +636,172 @@ public:
   Expression& assign(double value);
   double evaluate() const;
 
+  // Adding to a sum which is not shared updates it in place.
+  Expression& operator += (const Expression &e);
+  Expression& operator -= (const Expression &e);
+  // Multiplying a product which is not shared updates it in place.
+  Expression& operator *= (const Expression &e);
+  Expression& operator /= (const Expression &e);
+
   friend std::ostream& operator << (std::ostream& o, const Expression &e);
+
+  friend FlatExpression;
+  friend TermStream;
+  friend ExternalExpansion;
+  friend Budget;
+};
+
+/// Scope whose Expressions are allocated from its own Arena.
+/// The Context is current on the constructing thread until it is destroyed,
+/// and Contexts nest. Expressions built in a Context must not outlive it.
+class Symbol::Context {
+  std::unique_ptr<Impl_::Arena> arena_;
+  Impl_::Arena* previous_;
+public:
+  explicit Context(size_t chunkSize=1 << 16);
+  ~Context();
+  Context(const Context&) = delete;
+  Context& operator = (const Context&) = delete;
+
+  // Number of allocations which have not been released yet.
+  size_t live() const;
+  // Rewind the arena so that its memory is reused by later nodes.
+  // Nodes are not released by reset, so every Expression built in this
+  // Context must be gone already. Throws if any node is still alive.
+  void reset();
+};
+
+/// Limits on simplification on the constructing thread while in scope.
+/// An expansion is refused when its predicted number of terms exceeds
+/// maxTerms, or once maxNodes nodes were allocated or maxTime has passed,
+/// and one in progress is stopped when maxTime passes.
+/// A refused expansion is left unexpanded in FALLBACK mode, to be done
+/// when simplified again out of the scope, and throws in ABORT mode, where
+/// allocating beyond maxNodes or running beyond maxTime also throws.
+/// Budgets nest, and the enclosing ones still apply.
+class Symbol::Budget {
+public:
+  enum class Mode { FALLBACK, ABORT };
+private:
+  size_t maxNodes_;
+  size_t maxTerms_;
+  std::chrono::steady_clock::time_point deadline_;
+  Mode mode_;
+  size_t nodes_;
+  bool exceeded_;
+  Budget* previous_;
+
+  static Budget*& current();
+  bool expired() const;
+  void exceed(const char* message);
+public:
+  explicit Budget(size_t maxNodes = SIZE_MAX, size_t maxTerms = SIZE_MAX,
+                  std::chrono::milliseconds maxTime = std::chrono::milliseconds::max(),
+                  Mode mode = Mode::FALLBACK);
+  ~Budget();
+  Budget(const Budget&) = delete;
+  Budget& operator = (const Budget&) = delete;
+
+  // Number of nodes allocated in this scope.
+  size_t nodes() const;
+  // Whether any limit was hit, and an expansion refused.
+  bool exceeded() const;
+
+  // Upper bounds of the number of terms of the expansions,
+  // exact when no variable appears in more than one term of a factor.
+  static double predict(const std::vector<Expression>& factors);
+  static double predict(const Expression& base, uint32_t n);
+
+  friend bool Impl_::withinBudget(const pExp& e);
+  friend void Impl_::chargeNode();
+  friend pExp Impl_::expandPolynomial(pExp e);
+};
+
+/// Expression DAG stored as a contiguous array of nodes.
+/// Nodes are in topological order, operands before the operations using
+/// them, and the root is the last node. Operands are referred by 32-bit
+/// indices into the node array, so shared subtrees are stored once.
+/// VARIABLE nodes keep a copy of the value bound when they were converted.
+class Symbol::FlatExpression {
+public:
+  struct Node {
+    Impl_::Operator operator_;
+    // ID of VARIABLE name in SymbolTable
+    uint32_t symbol_;
+    // Range of operand indices in children_
+    uint32_t first_;
+    uint32_t count_;
+    // Value of CONST, or bound value of VARIABLE
+    double value_;
+  };
+private:
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> children_;
+
+  uint32_t push(Impl_::Operator oprtr, std::initializer_list<uint32_t> operands);
+  uint32_t push(Impl_::Operator oprtr, const std::vector<uint32_t>& operands);
+  uint32_t pushConst(double value);
+  FlatExpression prune(uint32_t root) const;
+  std::string toStr(uint32_t index, bool encloseBracket) const;
+public:
+  FlatExpression();
+  explicit FlatExpression(const Expression& e);
+
+  Expression toExpression() const;
+
+  size_t size() const;
+  const std::vector<Node>& nodes() const;
+  const std::vector<uint32_t>& children() const;
+
+  FlatExpression& assign(const std::string& name, double value);
+  double evaluate() const;
+  FlatExpression differentiate(const Expression& dx) const;
+  std::string toStr() const;
+
+  // Binary serialization. Variables are written by name.
+  void write(std::ostream& o) const;
+  static FlatExpression read(std::istream& i);
+};
+
+/// Terms of the expansion of a product or a power of Expressions,
+/// generated one at a time in the order of monomials, with like terms
+/// combined. Neither the expansion nor a partial product is stored:
+/// only the factors and a heap of the products of their terms which are
+/// next in line are kept, which is usually far fewer than the terms.
+class Symbol::TermStream {
+  std::unique_ptr<Impl_::PolynomialRing> ring_;
+  std::unique_ptr<Impl_::PolynomialStream> stream_;
+public:
+  explicit TermStream(const std::vector<Expression>& factors);
+  TermStream(const Expression& base, uint32_t n);
+  ~TermStream();
+
+  // Returns false when every term has been generated.
+  bool next(Expression& term);
+};
+
+/// Expansion of a product of Expressions which may not fit in memory.
+/// Factors are multiplied one by one. Each partial product is computed
+/// in chunks of about maxTerms terms, which are spilled to temporary files
+/// as sorted runs and merged from disk, so memory is bounded by maxTerms
+/// and the factors. Runs are merged whenever TermRun::MERGE_FANIN of them
+/// are open, which bounds the number of temporary files.
+/// The terms are in the order of monomials.
+class Symbol::ExternalExpansion {
+  std::unique_ptr<Impl_::PolynomialRing> ring_;
+  std::unique_ptr<Impl_::TermRun> run_;
+public:
+  explicit ExternalExpansion(const std::vector<Expression>& factors, size_t maxTerms = 1 << 20);
+  ~ExternalExpansion();
+
+  size_t size() const;
+  // Read the next term, returns false after the last one.
+  bool next(Expression& term);
+  void rewind();
+
+  Expression toExpression();
+  // Write the terms as text, one per line.
+  void write(std::ostream& o);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -314,7 +830,7 @@ void Symbol::Impl_::IndexMapper::IndexMapper::initIndices(size_t start, size_t s
 
 size_t Symbol::Impl_::IndexMapper::operator[] (int32_t ind) const {
   size_t n_indices = indices_.size();
-  while (index < 0) {
+  while (ind < 0) {
     ind += n_indices;
   }
   size_t index = ind;
@@ -652,208 +1168,1450 @@ Symbol::Impl_::Tensor Symbol::Impl_::eye(Shape shape, Type type) {
 }
 */
 ////////////////////////////////////////////////////////////////////////////////
-struct Symbol::Impl_::compareOperands {
-  inline bool operator() (const pExp& e1, const pExp& e2) const {
-    auto const1 = e1->isConst(), const2 = e2->isConst();
-    if (const1 && !const2) {
-      return true;
-    } else if (!const1 && const2) {
-        return false;
-    } else {
-      return e1->toStr(false) < e2->toStr(false);
+Symbol::Impl_::Arena::Arena(size_t chunkSize)
+  : chunkSize_(chunkSize)
+  , chunks_()
+  , chunkSizes_()
+  , chunk_(0)
+  , offset_(0)
+  , live_(0)
+{}
+
+Symbol::Impl_::Arena*& Symbol::Impl_::Arena::current() {
+  static thread_local Arena* arena = nullptr;
+  return arena;
+}
+
+void* Symbol::Impl_::Arena::allocate(size_t bytes, size_t alignment) {
+  while (chunk_ < chunks_.size()) {
+    auto base = reinterpret_cast<uintptr_t>(chunks_[chunk_].get());
+    auto aligned = (base + offset_ + alignment - 1) & ~(alignment - 1);
+    if (aligned + bytes <= base + chunkSizes_[chunk_]) {
+      offset_ = aligned + bytes - base;
+      ++live_;
+      return reinterpret_cast<void*>(aligned);
     }
+    ++chunk_;
+    offset_ = 0;
   }
-};
+  auto size = std::max(chunkSize_, bytes + alignment);
+  chunks_.emplace_back(new uint8_t[size]);
+  chunkSizes_.push_back(size);
+  chunk_ = chunks_.size() - 1;
+  return allocate(bytes, alignment);
+}
 
-Symbol::Impl_::Exp::Exp(double value)
-  : name_()
-  , pVal_(std::make_shared<double>(value))
-  , operator_(Operator::CONST)
-  , operands_()
-{
-  assertOperationConsistency();
+void Symbol::Impl_::Arena::deallocate(void* p, size_t bytes) {
+  --live_;
+  // Give back the most recent allocation, such as temporary Operands.
+  if (chunk_ < chunks_.size()) {
+    auto top = chunks_[chunk_].get() + offset_;
+    if (static_cast<uint8_t*>(p) + bytes == top) {
+      offset_ = static_cast<uint8_t*>(p) - chunks_[chunk_].get();
+    }
+  }
 }
 
-Symbol::Impl_::Exp::Exp(std::string name)
-  : name_(name)
-  , pVal_()
-  , operator_(Operator::VARIABLE)
-  , operands_()
-{
-  assertOperationConsistency();
+size_t Symbol::Impl_::Arena::live() const {
+  return live_;
 }
 
-Symbol::Impl_::Exp::Exp(std::string name, double value)
-  : name_(name)
-  , pVal_(std::make_shared<double>(value))
-  , operator_(Operator::VARIABLE)
-  , operands_()
-{
-  assertOperationConsistency();
+size_t Symbol::Impl_::Arena::capacity() const {
+  size_t ret = 0;
+  for (auto& size : chunkSizes_) {
+    ret += size;
+  }
+  return ret;
 }
 
-Symbol::Impl_::Exp::Exp(Operator oprtr, Operands oprnds)
-  : name_()
-  , pVal_()
-  , operator_(oprtr)
-  , operands_(oprnds)
-{
-  assertOperationConsistency();
+void Symbol::Impl_::Arena::reset() {
+  if (live_) {
+    LOG_AND_THROW("Cannot reset Arena while its allocations are alive.");
+  }
+  chunk_ = 0;
+  offset_ = 0;
 }
 
-void Symbol::Impl_::Exp::assertOperationConsistency() const {
-  std::string error_message;
-  for (auto& operand : operands_) {
-    if (!operand)
-      error_message = "NULL operand was given.";
+template<typename T>
+Symbol::Impl_::ArenaAllocator<T>::ArenaAllocator()
+  : arena_(Arena::current())
+{}
+
+template<typename T> template<typename U>
+Symbol::Impl_::ArenaAllocator<T>::ArenaAllocator(const ArenaAllocator<U>& other)
+  : arena_(other.arena_)
+{}
+
+template<typename T>
+T* Symbol::Impl_::ArenaAllocator<T>::allocate(size_t n) {
+  if (!arena_) {
+    return static_cast<T*>(::operator new(n * sizeof(T)));
   }
-  auto nOperands = operands_.size();
-  switch(operator_) {
-  case Operator::CONST:
-   if (nOperands)
-     error_message = "CONST Expression must not have operand.";
-   if (!pVal_)
-     error_message = "CONST Expression must have valid value.";
-   break;
-  case Operator::VARIABLE:
-   if (nOperands)
-     error_message = "VARIABLE Expression must not have operand.";
-   break;
-  case Operator::NEGATE:
-    if (nOperands != 1)
-      error_message = "NEGATE Expression must have exactly one operand.";
-    if (pVal_)
-      error_message = "NEGATE Expression must not have value.";
-    break;
-  case Operator::POWER:
-    if (nOperands != 2)
-      error_message = "POWER Expression must have two operands.";
-    if (pVal_)
-      error_message = "POWER Expression must not have value.";
-    break;
-  case Operator::ADD:
-    if (nOperands < 2)
-      error_message = "ADD Expression must have at least two operands.";
-    if (pVal_)
-      error_message = "ADD Expression must not have value.";
-    break;
-  case Operator::MULTIPLY:
-    if (nOperands < 2)
-      error_message = "MULTIPLY Expression must have at least two operands.";
-    if (pVal_)
-      error_message = "MULTIPLY Expression must not have value.";
-    break;
-  case Operator::LOG:
-    if (nOperands != 1)
-      error_message = "LOG Expression must have only exactly operand.";
-    if (pVal_)
-      error_message = "LOG Expression must not have value.";
-    if (operands_[0]->isConst()) {
-      if (!operands_[0]->isPositive()) {
-        error_message = "Operand of LOG Expression must greater than zero.";
-      }
-    }
-    break;
+  return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+}
+
+template<typename T>
+void Symbol::Impl_::ArenaAllocator<T>::deallocate(T* p, size_t n) {
+  if (!arena_) {
+    ::operator delete(p);
+  } else {
+    arena_->deallocate(p, n * sizeof(T));
   }
-  if (!error_message.empty()) {
-    LOG_AND_THROW(error_message);
+}
+
+template<typename T>
+Symbol::Impl_::Handle<T>::Handle() noexcept
+  : p_(nullptr)
+{}
+
+template<typename T>
+Symbol::Impl_::Handle<T>::Handle(std::nullptr_t) noexcept
+  : p_(nullptr)
+{}
+
+template<typename T>
+Symbol::Impl_::Handle<T>::Handle(T* p)
+  : p_(p)
+{
+  if (p_) {
+    p_->retain();
   }
-};
+}
 
-double Symbol::Impl_::Exp::value() const {
-  if (pVal_)
-    return *pVal_;
-  return NAN;
+template<typename T>
+Symbol::Impl_::Handle<T>::Handle(const Handle& other)
+  : Handle(other.p_)
+{}
+
+template<typename T>
+Symbol::Impl_::Handle<T>::Handle(Handle&& other) noexcept
+  : p_(other.p_)
+{
+  other.p_ = nullptr;
 }
 
-bool Symbol::Impl_::Exp::isConst() const {
-  return Operator::CONST == operator_;
+template<typename T>
+Symbol::Impl_::Handle<T>::~Handle() {
+  reset();
 }
 
-bool Symbol::Impl_::Exp::isZero() const {
-  return isConst() && pVal_ && isNearlyEqual(*pVal_, 0.0);
+template<typename T>
+Symbol::Impl_::Handle<T>& Symbol::Impl_::Handle<T>::operator = (const Handle& other) {
+  if (other.p_) {
+    other.p_->retain();
+  }
+  reset();
+  p_ = other.p_;
+  return *this;
 }
 
-bool Symbol::Impl_::Exp::isOne() const {
-  return isConst() && pVal_ && isNearlyEqual(*pVal_, 1.0);
+template<typename T>
+Symbol::Impl_::Handle<T>& Symbol::Impl_::Handle<T>::operator = (Handle&& other) noexcept {
+  if (this != &other) {
+    reset();
+    p_ = other.p_;
+    other.p_ = nullptr;
+  }
+  return *this;
 }
 
-bool Symbol::Impl_::Exp::isPositive() const {
-  return isConst() && !isZero() && value() > 0.0;
+template<typename T>
+T* Symbol::Impl_::Handle<T>::get() const {
+  return p_;
 }
 
-bool Symbol::Impl_::Exp::isNegative() const {
-  return isConst() && !isZero() && value() < 0.0;
+template<typename T>
+T& Symbol::Impl_::Handle<T>::operator * () const {
+  return *p_;
 }
 
-Symbol::pExp Symbol::Impl_::constructOne() {
-  return constructCONST(1);
+template<typename T>
+T* Symbol::Impl_::Handle<T>::operator -> () const {
+  return p_;
 }
 
-Symbol::pExp Symbol::Impl_::constructZero() {
-  return constructCONST(0);
+template<typename T>
+Symbol::Impl_::Handle<T>::operator bool () const {
+  return nullptr != p_;
 }
 
-Symbol::pExp Symbol::Impl_::constructCONST(const double c) {
-  return MAKE_SHARED_EXP(c);
+template<typename T>
+uint32_t Symbol::Impl_::Handle<T>::use_count() const {
+  return p_ ? p_->useCount() : 0;
 }
 
-Symbol::pExp Symbol::Impl_::constructVARIABLE(const std::string name) {
-  return MAKE_SHARED_EXP(name);
+template<typename T>
+void Symbol::Impl_::Handle<T>::reset() {
+  if (p_) {
+    // Clear first, release may destroy what refers to this handle.
+    T* p = p_;
+    p_ = nullptr;
+    p->release();
+  }
 }
 
-Symbol::pExp Symbol::Impl_::constructVARIABLE(const std::string name, const double c) {
-  return MAKE_SHARED_EXP(name, c);
+namespace Symbol {
+  namespace Impl_ {
+    template<typename T>
+    bool operator == (const Handle<T>& h1, const Handle<T>& h2) {
+      return h1.get() == h2.get();
+    }
+
+    template<typename T>
+    bool operator != (const Handle<T>& h1, const Handle<T>& h2) {
+      return h1.get() != h2.get();
+    }
+
+    template<typename T>
+    bool operator < (const Handle<T>& h1, const Handle<T>& h2) {
+      return std::less<T*>()(h1.get(), h2.get());
+    }
+
+    template<typename T>
+    std::ostream& operator << (std::ostream& o, const Handle<T>& h) {
+      return o << h.get();
+    }
+  };
+};
+
+template<typename T, size_t N>
+T* Symbol::Impl_::SmallVector<T, N>::inlineData() {
+  return reinterpret_cast<T*>(inline_);
 }
 
-Symbol::pExp Symbol::Impl_::constructNEGATE(const Operand v) {
-  return MAKE_SHARED_EXP(Operator::NEGATE, Operands {v});
+template<typename T, size_t N>
+bool Symbol::Impl_::SmallVector<T, N>::isInline() const {
+  return data_ == reinterpret_cast<const T*>(inline_);
 }
 
-Symbol::pExp Symbol::Impl_::constructADD(const Operands ops) {
-  switch(ops.size()) {
-  case 0:
-    return constructZero();
-  case 1:
-    return ops[0];
-  default:
-    return MAKE_SHARED_EXP(Operator::ADD, ops);
+template<typename T, size_t N>
+void Symbol::Impl_::SmallVector<T, N>::grow(size_t capacity) {
+  T* data = allocator_.allocate(capacity);
+  for (size_t i = 0; i < size_; ++i) {
+    new (data + i) T(std::move(data_[i]));
+    data_[i].~T();
+  }
+  if (!isInline()) {
+    allocator_.deallocate(data_, capacity_);
   }
+  data_ = data;
+  capacity_ = capacity;
 }
 
-Symbol::pExp Symbol::Impl_::constructMULTIPLY(const Operands ops) {
-  switch(ops.size()) {
-  case 0:
-    return constructOne();
-  case 1:
-    return ops[0];
-  default:
-    return MAKE_SHARED_EXP(Operator::MULTIPLY, ops);
+template<typename T, size_t N>
+void Symbol::Impl_::SmallVector<T, N>::release() {
+  clear();
+  if (!isInline()) {
+    allocator_.deallocate(data_, capacity_);
   }
+  data_ = inlineData();
+  capacity_ = N;
 }
 
-Symbol::pExp Symbol::Impl_::constructPOWER(const Operands ops) {
-  return MAKE_SHARED_EXP(Operator::POWER, ops);
+template<typename T, size_t N>
+Symbol::Impl_::SmallVector<T, N>::SmallVector()
+  : data_(inlineData())
+  , size_(0)
+  , capacity_(N)
+  , allocator_()
+{}
+
+template<typename T, size_t N>
+Symbol::Impl_::SmallVector<T, N>::SmallVector(std::initializer_list<T> init)
+  : SmallVector()
+{
+  insert(end(), init.begin(), init.end());
 }
 
-Symbol::pExp Symbol::Impl_::constructInverse(const Operand o) {
-  return constructPOWER({o, constructCONST(-1)});
+template<typename T, size_t N>
+Symbol::Impl_::SmallVector<T, N>::SmallVector(const SmallVector& other)
+  : SmallVector()
+{
+  insert(end(), other.begin(), other.end());
 }
 
-Symbol::pExp Symbol::Impl_::constructLOG(const Operand v) {
-  return MAKE_SHARED_EXP(Operator::LOG, Operands {v});
+template<typename T, size_t N>
+Symbol::Impl_::SmallVector<T, N>::SmallVector(SmallVector&& other) noexcept
+  : SmallVector()
+{
+  *this = std::move(other);
 }
 
-Symbol::pExp Symbol::Impl_::flatten(const pExp e) {
-  switch(e->operator_) {
-  case Operator::NEGATE:
-    return flattenNEGATE(e);
-  case Operator::ADD:
-  case Operator::MULTIPLY:
-    return flattenMultiOperands(e);
-  default:
-    return e;
-  }
+template<typename T, size_t N>
+Symbol::Impl_::SmallVector<T, N>::~SmallVector() {
+  release();
+}
+
+template<typename T, size_t N>
+Symbol::Impl_::SmallVector<T, N>& Symbol::Impl_::SmallVector<T, N>::operator = (const SmallVector& other) {
+  if (this != &other) {
+    clear();
+    insert(end(), other.begin(), other.end());
+  }
+  return *this;
+}
+
+template<typename T, size_t N>
+Symbol::Impl_::SmallVector<T, N>& Symbol::Impl_::SmallVector<T, N>::operator = (SmallVector&& other) noexcept {
+  if (this == &other) {
+    return *this;
+  }
+  release();
+  if (other.isInline()) {
+    for (size_t i = 0; i < other.size_; ++i) {
+      new (data_ + i) T(std::move(other.data_[i]));
+    }
+    size_ = other.size_;
+    other.clear();
+  } else {
+    // Steal the buffer together with the allocator that owns it.
+    data_ = other.data_;
+    size_ = other.size_;
+    capacity_ = other.capacity_;
+    allocator_ = other.allocator_;
+    other.data_ = other.inlineData();
+    other.size_ = 0;
+    other.capacity_ = N;
+  }
+  return *this;
+}
+
+template<typename T, size_t N>
+T* Symbol::Impl_::SmallVector<T, N>::begin() {
+  return data_;
+}
+
+template<typename T, size_t N>
+T* Symbol::Impl_::SmallVector<T, N>::end() {
+  return data_ + size_;
+}
+
+template<typename T, size_t N>
+const T* Symbol::Impl_::SmallVector<T, N>::begin() const {
+  return data_;
+}
+
+template<typename T, size_t N>
+const T* Symbol::Impl_::SmallVector<T, N>::end() const {
+  return data_ + size_;
+}
+
+template<typename T, size_t N>
+size_t Symbol::Impl_::SmallVector<T, N>::size() const {
+  return size_;
+}
+
+template<typename T, size_t N>
+bool Symbol::Impl_::SmallVector<T, N>::empty() const {
+  return 0 == size_;
+}
+
+template<typename T, size_t N>
+size_t Symbol::Impl_::SmallVector<T, N>::capacity() const {
+  return capacity_;
+}
+
+template<typename T, size_t N>
+T& Symbol::Impl_::SmallVector<T, N>::operator[] (size_t i) {
+  return data_[i];
+}
+
+template<typename T, size_t N>
+const T& Symbol::Impl_::SmallVector<T, N>::operator[] (size_t i) const {
+  return data_[i];
+}
+
+template<typename T, size_t N>
+T& Symbol::Impl_::SmallVector<T, N>::back() {
+  return data_[size_ - 1];
+}
+
+template<typename T, size_t N>
+const T& Symbol::Impl_::SmallVector<T, N>::back() const {
+  return data_[size_ - 1];
+}
+
+template<typename T, size_t N>
+void Symbol::Impl_::SmallVector<T, N>::reserve(size_t capacity) {
+  if (capacity > capacity_) {
+    grow(capacity);
+  }
+}
+
+template<typename T, size_t N>
+void Symbol::Impl_::SmallVector<T, N>::push_back(const T& value) {
+  if (size_ == capacity_) {
+    // value may refer to an element of this vector.
+    T copy(value);
+    grow(2 * capacity_);
+    new (data_ + size_) T(std::move(copy));
+  } else {
+    new (data_ + size_) T(value);
+  }
+  ++size_;
+}
+
+template<typename T, size_t N>
+void Symbol::Impl_::SmallVector<T, N>::push_back(T&& value) {
+  if (size_ == capacity_) {
+    T moved(std::move(value));
+    grow(2 * capacity_);
+    new (data_ + size_) T(std::move(moved));
+  } else {
+    new (data_ + size_) T(std::move(value));
+  }
+  ++size_;
+}
+
+template<typename T, size_t N>
+void Symbol::Impl_::SmallVector<T, N>::pop_back() {
+  data_[--size_].~T();
+}
+
+template<typename T, size_t N>
+void Symbol::Impl_::SmallVector<T, N>::clear() {
+  for (size_t i = 0; i < size_; ++i) {
+    data_[i].~T();
+  }
+  size_ = 0;
+}
+
+template<typename T, size_t N> template<typename InputIt>
+T* Symbol::Impl_::SmallVector<T, N>::insert(const T* pos, InputIt first, InputIt last) {
+  size_t offset = pos - data_;
+  size_t oldSize = size_;
+  for (; first != last; ++first) {
+    push_back(*first);
+  }
+  std::rotate(data_ + offset, data_ + oldSize, data_ + size_);
+  return data_ + offset;
+}
+
+namespace Symbol {
+  namespace Impl_ {
+    template<typename T, typename U>
+    bool operator == (const ArenaAllocator<T>& a1, const ArenaAllocator<U>& a2) {
+      return a1.arena_ == a2.arena_;
+    }
+
+    template<typename T, typename U>
+    bool operator != (const ArenaAllocator<T>& a1, const ArenaAllocator<U>& a2) {
+      return a1.arena_ != a2.arena_;
+    }
+  };
+};
+
+struct Symbol::Impl_::compareOperands {
+  inline bool operator() (const pExp& e1, const pExp& e2) const {
+    return compare(*e1, *e2) < 0;
+  }
+};
+
+/// o == coeff_ * term_
+/// term_ is null when o is CONST. The coefficient of a MULTIPLY term_
+/// is not part of the term and must be ignored.
+struct Symbol::Impl_::Decomposed2 {
+  double coeff_;
+  pExp term_;
+};
+
+/// o == coeff_ * (base_ ^ expo_)
+/// base_ is null when o is CONST, and expo_ is null when the exponent
+/// is the number in numericExpo_.
+struct Symbol::Impl_::Decomposed3 {
+  double coeff_;
+  pExp base_;
+  pExp expo_;
+  double numericExpo_;
+};
+
+/// Change of one operand of ADD or MULTIPLY planned for an in-place update.
+/// key_ is the term or base in the index. previous_ is null for a new
+/// operand, and operand_ is null when the operand is removed.
+struct Symbol::Impl_::OperandChange {
+  pExp key_;
+  pExp previous_;
+  pExp operand_;
+};
+
+/// Hash and equality of operands for unordered containers.
+/// Both use the structural hash cached in Exp, so that lookups do not
+/// traverse the operands unless the hashes collide.
+struct Symbol::Impl_::hashOperand {
+  inline size_t operator() (const pExp& e) const {
+    return static_cast<size_t>(e->hash());
+  }
+};
+
+struct Symbol::Impl_::equalOperand {
+  inline bool operator() (const pExp& e1, const pExp& e2) const {
+    return isSame(e1, e2);
+  }
+};
+
+/// Equality of terms up to the coefficients of MULTIPLY,
+/// so that 2 * X * Y and 3 * X * Y are the same term.
+struct Symbol::Impl_::equalTerm {
+  inline bool operator() (const pExp& e1, const pExp& e2) const {
+    if (Operator::MULTIPLY == e1->operator_ && Operator::MULTIPLY == e2->operator_) {
+      return e1 == e2 || 0 == compareOperandsOf(*e1, *e2);
+    }
+    return isSame(e1, e2);
+  }
+};
+
+/// Threads shared by every parallel multiplication, started on demand.
+/// The thread calling run takes part in the work and, while waiting for
+/// its tasks, runs any queued task, so nested calls neither block nor add
+/// threads. The number of threads is bounded by the largest count asked.
+class Symbol::Impl_::WorkerPool {
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  // Run the latest first, so that nested tasks finish before outer ones.
+  std::vector<std::function<void()>> queue_;
+  std::vector<std::thread> workers_;
+  bool stopping_;
+
+  WorkerPool();
+  void work();
+public:
+  ~WorkerPool();
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator = (const WorkerPool&) = delete;
+
+  static WorkerPool& instance();
+
+  // Run every task on up to nThreads threads including the calling one,
+  // and return when all of them finished. The first exception is rethrown.
+  void run(const std::vector<std::function<void()>>& tasks, size_t nThreads);
+};
+
+/// Sparse multivariate polynomial with real coefficients.
+/// Exponents of each term are packed into 64-bit words, BITS per variable,
+/// so that multiplying monomials is adding words and comparing them is
+/// comparing words. Terms are sorted in the descending lexicographic order
+/// of exponents and like terms are combined.
+class Symbol::Impl_::Polynomial {
+public:
+  static const uint32_t BITS = 16;
+  static const uint32_t MAX_DEGREE = (1u << BITS) - 1;
+  static const size_t VARIABLES_PER_WORD = 64 / BITS;
+  // Dense products shorter than this are multiplied by the schoolbook method.
+  static const size_t KARATSUBA_THRESHOLD = 32;
+  // Products with fewer term pairs per thread than this are not parallelized.
+  static const size_t PARALLEL_THRESHOLD = 1 << 14;
+private:
+  size_t words_;
+  std::vector<uint64_t> exponents_;
+  std::vector<double> coeffs_;
+  // Upper bound of the total degree of the terms
+  uint32_t degree_;
+
+  const uint64_t* monomial(size_t i) const;
+  void push(const uint64_t* monomial, double coeff);
+  void dropCancelled();
+
+  Polynomial slice(size_t begin, size_t end) const;
+  Polynomial multiplyHeap(const Polynomial& other) const;
+  Polynomial multiplyParallel(const Polynomial& other, size_t nThreads) const;
+
+  bool isDenseUnivariate() const;
+  bool isKaratsubaAccurate(const Polynomial& other) const;
+  Polynomial multiplyDense(const Polynomial& other) const;
+  static void karatsuba(const double* a, const double* b, size_t n, double* out);
+
+  bool hasDisjointTerms() const;
+  int compare(const uint64_t* m1, const uint64_t* m2) const;
+  static std::atomic<size_t>& threadCount();
+public:
+  // Thrown by the operations once the Deadline in scope has passed.
+  struct Expired {};
+  // Time limit on the operations on the constructing thread while in scope.
+  // Deadlines nest, and the earliest one applies.
+  class Deadline {
+    std::chrono::steady_clock::time_point previous_;
+  public:
+    explicit Deadline(std::chrono::steady_clock::time_point at);
+    ~Deadline();
+    Deadline(const Deadline&) = delete;
+    Deadline& operator = (const Deadline&) = delete;
+
+    static std::chrono::steady_clock::time_point& current();
+    // Throws Expired when the Deadline in scope has passed.
+    static void check();
+  };
+
+  explicit Polynomial(size_t nVariables);
+
+  // Number of 64-bit words packing the exponents of a monomial
+  static size_t words(size_t nVariables);
+  static uint32_t exponentOf(const uint64_t* monomial, size_t variable);
+
+  // Number of threads used for multiplication, the number of cores by default.
+  // May be changed while other threads multiply.
+  static size_t threads();
+  static void setThreads(size_t n);
+
+  static Polynomial constant(size_t nVariables, double c);
+  static Polynomial variable(size_t nVariables, size_t index);
+
+  size_t size() const;
+  uint32_t degree() const;
+  double coefficient(size_t i) const;
+  uint32_t exponent(size_t i, size_t variable) const;
+
+  Polynomial operator + (const Polynomial& other) const;
+  Polynomial operator * (const Polynomial& other) const;
+  Polynomial operator * (double c) const;
+  Polynomial pow(uint32_t n) const;
+
+  friend PolynomialStream;
+  friend TermRun;
+};
+
+/// Terms of a product or a power of Polynomials, generated one at a time
+/// in the order of monomials with like terms combined.
+/// Products of two are merged by Johnson's heap, keeping one cursor per row.
+/// Powers of disjoint terms are enumerated by the multinomial theorem.
+/// Products of several factors, and other powers, are merged by a heap of
+/// the pending nodes of a lattice, see nextNode, so that neither the
+/// product of some of the factors nor a partial power is computed.
+class Symbol::Impl_::PolynomialStream {
+  enum class Mode {
+    PRODUCT, MULTINOMIAL, FACTORS, POWER
+  };
+  // The Deadline is checked every this many iterations.
+  static const size_t POLL_INTERVAL = 1024;
+  Mode mode_;
+  size_t words_;
+  // Row i of the product is the columns shifted by the term i of the rows.
+  Polynomial rows_;
+  Polynomial columns_;
+  // The column of the next product and its monomial, for each row,
+  // or the monomial of each node in the lattice modes
+  std::vector<size_t> cursors_;
+  std::vector<uint64_t> products_;
+  // Max-heap of rows, or of nodes, by their monomials
+  std::vector<size_t> heap_;
+
+  // Exponent of the power
+  uint32_t n_;
+  // Exponent of each term, and binomial(remaining, exponent)
+  std::vector<uint32_t> ks_;
+  std::vector<double> binomials_;
+  std::vector<std::vector<double>> powers_;
+
+  // Factors of the product, or the base of the power
+  std::vector<Polynomial> factors_;
+  // Term index in each factor, or the exponent of each term of the base,
+  // and the coefficient, or the multinomial coefficient, of each node.
+  // Slots of popped nodes are reused.
+  std::vector<uint32_t> indices_;
+  std::vector<double> weights_;
+  std::vector<size_t> free_;
+  // The last popped node and its monomial
+  std::vector<uint32_t> node_;
+  std::vector<uint64_t> parent_;
+  std::vector<uint64_t> next_;
+
+  // Current term
+  std::vector<uint64_t> monomial_;
+  double coeff_;
+  // Iterations since the Deadline was last checked
+  size_t steps_;
+
+  int compare(const uint64_t* m1, const uint64_t* m2) const;
+  void poll();
+  void pushHeap(size_t i);
+  size_t popHeap();
+  void pushRow(size_t row);
+  void advance(size_t row);
+  bool nextProduct();
+  bool nextMultinomial();
+  void pushNode(const uint64_t* monomial, double weight);
+  double popNode();
+  bool nextNode();
+public:
+  PolynomialStream(const Polynomial& rows, const Polynomial& columns);
+  explicit PolynomialStream(const std::vector<Polynomial>& factors);
+  PolynomialStream(const Polynomial& base, uint32_t n);
+
+  // Returns false when every term has been generated.
+  bool next();
+  const uint64_t* monomial() const;
+  double coefficient() const;
+  uint32_t exponent(size_t variable) const;
+};
+
+/// Sorted terms of a Polynomial spilled to a temporary file,
+/// which is removed when the run is destroyed.
+class Symbol::Impl_::TermRun {
+  struct Close {
+    void operator()(FILE* file) const;
+  };
+  std::unique_ptr<FILE, Close> file_;
+  size_t words_;
+  size_t size_;
+public:
+  // Runs with more inputs than this are merged in several passes.
+  static const size_t MERGE_FANIN = 64;
+
+  explicit TermRun(size_t words);
+
+  size_t size() const;
+  void push(const uint64_t* monomial, double coeff);
+  void push(const Polynomial& p);
+  // Read from the first term again.
+  void rewind();
+  bool read(uint64_t* monomial, double& coeff);
+  // Read up to n terms into p, returns false when no term is left.
+  bool read(Polynomial& p, size_t n);
+
+  // Merge the runs into one, combining like terms.
+  static TermRun merge(std::vector<TermRun>& runs, size_t words);
+};
+
+/// Conversion between Expressions and Polynomials.
+/// Sums, products, constants and powers with positive integer exponents
+/// are polynomial operations, any other subexpression is a variable
+/// of the ring, called atom.
+class Symbol::Impl_::PolynomialRing {
+  std::vector<pExp> atoms_;
+  std::unordered_map<pExp, size_t, hashOperand, equalOperand> indices_;
+
+  static bool isPower(const pExp& e);
+  void collect(const pExp& e);
+  void sortAtoms();
+public:
+  explicit PolynomialRing(const pExp& e);
+  explicit PolynomialRing(const Operands& es);
+
+  size_t size() const;
+  // Returns false when a degree exceeds Polynomial::MAX_DEGREE.
+  bool toPolynomial(const pExp& e, Polynomial& p) const;
+  pExp toExp(const Polynomial& p) const;
+  pExp toTerm(const std::vector<uint32_t>& exponents, double coeff) const;
+};
+
+/// Structural total order of Expressions, used to sort operands.
+/// CONST comes first, ordered by value. VARIABLE is ordered by name and
+/// NEGATE by its operand so that printed Expressions stay readable.
+/// Other operations are ordered by their cached hash, then by operands.
+/// Returns negative, zero or positive as strcmp does.
+int Symbol::Impl_::compare(const Exp& e1, const Exp& e2) {
+  if (&e1 == &e2) {
+    return 0;
+  }
+  auto rank = [](const Operator oprtr) {
+    switch(oprtr) {
+    case Operator::CONST:
+      return 0;
+    case Operator::NEGATE:
+      return 1;
+    case Operator::VARIABLE:
+      return 2;
+    case Operator::ADD:
+      return 3;
+    case Operator::MULTIPLY:
+      return 4;
+    case Operator::POWER:
+      return 5;
+    case Operator::LOG:
+      return 6;
+    }
+    return 7;
+  };
+  auto rank1 = rank(e1.operator_), rank2 = rank(e2.operator_);
+  if (rank1 != rank2) {
+    return rank1 < rank2 ? -1 : 1;
+  }
+  switch(e1.operator_) {
+  case Operator::CONST: {
+    auto val1 = e1.value(), val2 = e2.value();
+    return val1 < val2 ? -1 : (val2 < val1 ? 1 : 0);
+  }
+  case Operator::VARIABLE: {
+    if (e1.symbol_ == e2.symbol_) {
+      return 0;
+    }
+    auto& table = SymbolTable::instance();
+    return table.name(e1.symbol_).compare(table.name(e2.symbol_));
+  }
+  case Operator::NEGATE:
+    return compare(*e1.operands_[0], *e2.operands_[0]);
+  default:
+    break;
+  }
+  if (e1.hash_ != e2.hash_) {
+    return e1.hash_ < e2.hash_ ? -1 : 1;
+  }
+  auto ret = compareOperandsOf(e1, e2);
+  if (ret) {
+    return ret;
+  }
+  auto val1 = e1.value_, val2 = e2.value_;
+  if (e1.hasCoefficient() || e2.hasCoefficient()) {
+    return val1 < val2 ? -1 : (val2 < val1 ? 1 : 0);
+  }
+  return 0;
+}
+
+/// Compare the operands only, ignoring the coefficients.
+int Symbol::Impl_::compareOperandsOf(const Exp& e1, const Exp& e2) {
+  auto n1 = e1.operands_.size(), n2 = e2.operands_.size();
+  if (n1 != n2) {
+    return n1 < n2 ? -1 : 1;
+  }
+  for (size_t i = 0; i < n1; ++i) {
+    auto ret = compare(*e1.operands_[i], *e2.operands_[i]);
+    if (ret) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/// Structural equality. Pointer and hash are checked first
+/// so that most of the unequal cases are rejected without traversal.
+bool Symbol::Impl_::isSame(const pExp& e1, const pExp& e2) {
+  if (e1 == e2) {
+    return true;
+  }
+  return e1->hash() == e2->hash() && 0 == compare(*e1, *e2);
+}
+
+Symbol::Impl_::ConstantTable::ConstantTable()
+  : integers_()
+  , half_()
+  , minusHalf_()
+{
+  // Allocate from the heap even when a Context is active,
+  // as the nodes must outlive it.
+  auto& current = Arena::current();
+  auto previous = current;
+  current = nullptr;
+  for (int i = MIN_INTEGER; i <= MAX_INTEGER; ++i) {
+    integers_.push_back(MAKE_SHARED_EXP(static_cast<double>(i)));
+  }
+  half_ = MAKE_SHARED_EXP(0.5);
+  minusHalf_ = MAKE_SHARED_EXP(-0.5);
+  current = previous;
+  // Constants are already canonical. Marking them here keeps simplify
+  // from writing to the shared nodes.
+  for (auto& e : integers_) {
+    e->simplified_.store(true, std::memory_order_relaxed);
+  }
+  half_->simplified_.store(true, std::memory_order_relaxed);
+  minusHalf_->simplified_.store(true, std::memory_order_relaxed);
+}
+
+const Symbol::Impl_::ConstantTable& Symbol::Impl_::ConstantTable::instance() {
+  static const ConstantTable table;
+  return table;
+}
+
+const Symbol::pExp* Symbol::Impl_::ConstantTable::find(const double value) const {
+  if (MIN_INTEGER <= value && value <= MAX_INTEGER) {
+    auto i = static_cast<int>(value);
+    if (i == value) {
+      // -0.0 is stored as 0.0, they compare equal.
+      return &integers_[i - MIN_INTEGER];
+    }
+    if (0.5 == value) {
+      return &half_;
+    }
+    if (-0.5 == value) {
+      return &minusHalf_;
+    }
+  }
+  return nullptr;
+}
+
+Symbol::Impl_::SymbolTable::SymbolTable()
+  : mutex_()
+  , ids_()
+  , chunks_()
+  , size_(0)
+{}
+
+Symbol::Impl_::SymbolTable& Symbol::Impl_::SymbolTable::instance() {
+  static SymbolTable table;
+  return table;
+}
+
+size_t Symbol::Impl_::SymbolTable::chunkOf(uint32_t id, size_t& offset) {
+  size_t n = id / FIRST_CHUNK + 1, k = 0;
+  while (n >>= 1) {
+    ++k;
+  }
+  // IDs before chunk k: FIRST_CHUNK * (2 ^ k - 1)
+  offset = id - FIRST_CHUNK * ((size_t(1) << k) - 1);
+  return k;
+}
+
+uint32_t Symbol::Impl_::SymbolTable::intern(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = ids_.find(name);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+  if (std::numeric_limits<uint32_t>::max() == size_) {
+    LOG_AND_THROW("Too many variable names.");
+  }
+  uint32_t id = size_;
+  size_t offset;
+  auto k = chunkOf(id, offset);
+  if (!chunks_[k]) {
+    chunks_[k].reset(new Entry[FIRST_CHUNK << k]);
+  }
+  // Hash of the name, not the ID, so that it does not depend on
+  // the order in which the names are interned. FNV-1a.
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (auto c : name) {
+    h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+  }
+  auto& e = chunks_[k][offset];
+  e.name_ = name;
+  e.hash_ = h;
+  ids_.emplace(name, id);
+  ++size_;
+  return id;
+}
+
+const std::string& Symbol::Impl_::SymbolTable::name(uint32_t id) const {
+  size_t offset;
+  auto k = chunkOf(id, offset);
+  return chunks_[k][offset].name_;
+}
+
+uint64_t Symbol::Impl_::SymbolTable::hash(uint32_t id) const {
+  size_t offset;
+  auto k = chunkOf(id, offset);
+  return chunks_[k][offset].hash_;
+}
+
+size_t Symbol::Impl_::SymbolTable::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+Symbol::Impl_::UniqueTable::UniqueTable()
+  : enabled_(false)
+  , size_(0)
+  , buckets_()
+{}
+
+Symbol::Impl_::UniqueTable::~UniqueTable() {
+  clear();
+}
+
+Symbol::Impl_::UniqueTable& Symbol::Impl_::UniqueTable::instance() {
+  static UniqueTable table;
+  return table;
+}
+
+void Symbol::Impl_::UniqueTable::enable(bool enable) {
+  enabled_ = enable;
+  if (!enabled_) {
+    clear();
+  }
+}
+
+bool Symbol::Impl_::UniqueTable::isEnabled() const {
+  return enabled_;
+}
+
+size_t Symbol::Impl_::UniqueTable::size() const {
+  return size_;
+}
+
+bool Symbol::Impl_::UniqueTable::matches
+(const Exp& e, const Operator oprtr, const double value, const Operands& ops) {
+  if (e.operator_ != oprtr || e.operands_.size() != ops.size()) {
+    return false;
+  }
+  if (Operator::CONST == oprtr && e.value() != value) {
+    return false;
+  }
+  if ((Operator::ADD == oprtr || Operator::MULTIPLY == oprtr) && e.value_ != value) {
+    return false;
+  }
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (e.operands_[i] != ops[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Symbol::pExp Symbol::Impl_::UniqueTable::find
+(const Operator oprtr, const double value, const Operands& ops) const {
+  // Buckets are keyed by the structural hash, computed here from
+  // the hashes cached in operands without allocating the node.
+  auto it = buckets_.find(Exp::structuralHash(oprtr, value, 0, ops));
+  if (it == buckets_.end()) {
+    return pExp();
+  }
+  for (auto& entry : it->second) {
+    if (matches(*entry, oprtr, value, ops)) {
+      return pExp(entry);
+    }
+  }
+  return pExp();
+}
+
+void Symbol::Impl_::UniqueTable::insert(const pExp& e) {
+  buckets_[e->hash()].push_back(e.get());
+  e->interned_ = true;
+  ++size_;
+}
+
+void Symbol::Impl_::UniqueTable::erase(Exp* e) {
+  auto it = buckets_.find(e->hash());
+  if (it == buckets_.end()) {
+    return;
+  }
+  auto& bucket = it->second;
+  auto entry = std::find(bucket.begin(), bucket.end(), e);
+  if (entry != bucket.end()) {
+    bucket.erase(entry);
+    e->interned_ = false;
+    --size_;
+  }
+}
+
+/// Release the memory of buckets emptied by destroyed nodes.
+void Symbol::Impl_::UniqueTable::sweep() {
+  for (auto it = buckets_.begin(); it != buckets_.end();) {
+    if (it->second.empty()) {
+      it = buckets_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void Symbol::Impl_::UniqueTable::clear() {
+  for (auto& entry : buckets_) {
+    for (auto e : entry.second) {
+      e->interned_ = false;
+    }
+  }
+  buckets_.clear();
+  size_ = 0;
+}
+
+Symbol::Impl_::Exp::Exp(double value)
+  : symbol_(0)
+  , value_(value)
+  , pBinding_()
+  , operator_(Operator::CONST)
+  , operands_()
+  , hash_(0)
+  , simplified_(false)
+  , interned_(false)
+  , arena_(nullptr)
+  , refCount_(0)
+  , terms_()
+{
+  assertOperationConsistency();
+  computeHash();
+}
+
+Symbol::Impl_::Exp::Exp(std::string name)
+  : symbol_(SymbolTable::instance().intern(name))
+  , value_(NAN)
+  , pBinding_()
+  , operator_(Operator::VARIABLE)
+  , operands_()
+  , hash_(0)
+  , simplified_(false)
+  , interned_(false)
+  , arena_(nullptr)
+  , refCount_(0)
+  , terms_()
+{
+  assertOperationConsistency();
+  computeHash();
+}
+
+Symbol::Impl_::Exp::Exp(std::string name, double value)
+  : symbol_(SymbolTable::instance().intern(name))
+  , value_(NAN)
+  , pBinding_(std::allocate_shared<double>(ArenaAllocator<double>(), value))
+  , operator_(Operator::VARIABLE)
+  , operands_()
+  , hash_(0)
+  , simplified_(false)
+  , interned_(false)
+  , arena_(nullptr)
+  , refCount_(0)
+  , terms_()
+{
+  assertOperationConsistency();
+  computeHash();
+}
+
+Symbol::Impl_::Exp::Exp(Operator oprtr, Operands oprnds)
+  : Exp(oprtr, oprnds, identity(oprtr))
+{}
+
+Symbol::Impl_::Exp::Exp(Operator oprtr, Operands oprnds, double coefficient)
+  : symbol_(0)
+  , value_(Operator::ADD == oprtr || Operator::MULTIPLY == oprtr ? coefficient : NAN)
+  , pBinding_()
+  , operator_(oprtr)
+  , operands_(oprnds)
+  , hash_(0)
+  , simplified_(false)
+  , interned_(false)
+  , arena_(nullptr)
+  , refCount_(0)
+  , terms_()
+{
+  assertOperationConsistency();
+  computeHash();
+}
+
+void Symbol::Impl_::Exp::assertOperationConsistency() const {
+  std::string error_message;
+  for (auto& operand : operands_) {
+    if (!operand)
+      error_message = "NULL operand was given.";
+  }
+  auto nOperands = operands_.size();
+  switch(operator_) {
+  case Operator::CONST:
+   if (nOperands)
+     error_message = "CONST Expression must not have operand.";
+   if (pBinding_)
+     error_message = "CONST Expression must not have binding.";
+   break;
+  case Operator::VARIABLE:
+   if (nOperands)
+     error_message = "VARIABLE Expression must not have operand.";
+   break;
+  case Operator::NEGATE:
+    if (nOperands != 1)
+      error_message = "NEGATE Expression must have exactly one operand.";
+    if (pBinding_)
+      error_message = "NEGATE Expression must not have value.";
+    break;
+  case Operator::POWER:
+    if (nOperands != 2)
+      error_message = "POWER Expression must have two operands.";
+    if (pBinding_)
+      error_message = "POWER Expression must not have value.";
+    break;
+  case Operator::ADD:
+    if (nOperands + hasCoefficient() < 2)
+      error_message = "ADD Expression must have at least two operands.";
+    if (pBinding_)
+      error_message = "ADD Expression must not have value.";
+    break;
+  case Operator::MULTIPLY:
+    if (nOperands + hasCoefficient() < 2)
+      error_message = "MULTIPLY Expression must have at least two operands.";
+    if (pBinding_)
+      error_message = "MULTIPLY Expression must not have value.";
+    break;
+  case Operator::LOG:
+    if (nOperands != 1)
+      error_message = "LOG Expression must have only exactly operand.";
+    if (pBinding_)
+      error_message = "LOG Expression must not have value.";
+    if (operands_[0]->isConst()) {
+      if (!operands_[0]->isPositive()) {
+        error_message = "Operand of LOG Expression must greater than zero.";
+      }
+    }
+    break;
+  }
+  if (!error_message.empty()) {
+    LOG_AND_THROW(error_message);
+  }
+};
+
+/// Structural hash from the operator, the value or name and the hashes of
+/// operands. Values of VARIABLE are not included as they can be reassigned.
+/// Coefficients of ADD and MULTIPLY are not included either, so that terms
+/// differing only in their coefficient fall into the same bucket.
+/// Operands of ADD and MULTIPLY are summed, so the hash does not depend on
+/// their order and can be updated when a term is appended in place.
+/// Computed without std::hash so that it is the same on every run.
+void Symbol::Impl_::Exp::computeHash() {
+  hash_ = structuralHash(operator_, value_, symbol_, operands_);
+}
+
+uint64_t Symbol::Impl_::Exp::mix(uint64_t h) {
+  h += 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+uint64_t Symbol::Impl_::Exp::structuralHash
+(const Operator oprtr, const double value, const uint32_t symbol, const Operands& ops) {
+  auto combine = [](uint64_t seed, uint64_t h) {
+    return seed ^ mix(h + (seed << 6) + (seed >> 2));
+  };
+  uint64_t ret = combine(0, static_cast<uint64_t>(oprtr) + 1);
+  switch(oprtr) {
+  case Operator::CONST: {
+    // 0.0 and -0.0 must hash the same as they compare equal.
+    double val = (0.0 == value) ? 0.0 : value;
+    uint64_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    ret = combine(ret, bits);
+    break;
+  }
+  case Operator::VARIABLE:
+    ret = combine(ret, SymbolTable::instance().hash(symbol));
+    break;
+  case Operator::ADD:
+  case Operator::MULTIPLY:
+    for (auto& operand : ops) {
+      ret += mix(operand->hash_);
+    }
+    break;
+  default:
+    for (auto& operand : ops) {
+      ret = combine(ret, operand->hash_);
+    }
+  }
+  return ret;
+}
+
+void Symbol::Impl_::Exp::retain() const {
+  ++refCount_;
+}
+
+void Symbol::Impl_::Exp::release() const {
+  if (0 != --refCount_) {
+    return;
+  }
+  auto e = const_cast<Exp*>(this);
+  if (e->interned_) {
+    UniqueTable::instance().erase(e);
+  }
+  ArenaAllocator<Exp> allocator;
+  allocator.arena_ = e->arena_;
+  e->~Exp();
+  allocator.deallocate(e, 1);
+}
+
+uint32_t Symbol::Impl_::Exp::useCount() const {
+  return refCount_;
+}
+
+uint64_t Symbol::Impl_::Exp::hash() const {
+  return hash_;
+}
+
+const std::string& Symbol::Impl_::Exp::name() const {
+  static const std::string empty;
+  if (Operator::VARIABLE != operator_) {
+    return empty;
+  }
+  return SymbolTable::instance().name(symbol_);
+}
+
+double Symbol::Impl_::Exp::value() const {
+  if (isConst())
+    return value_;
+  if (pBinding_)
+    return *pBinding_;
+  return NAN;
+}
+
+bool Symbol::Impl_::Exp::isConst() const {
+  return Operator::CONST == operator_;
+}
+
+bool Symbol::Impl_::Exp::isZero() const {
+  return isConst() && isNearlyEqual(value_, 0.0);
+}
+
+bool Symbol::Impl_::Exp::isOne() const {
+  return isConst() && isNearlyEqual(value_, 1.0);
+}
+
+bool Symbol::Impl_::Exp::isSimplified() const {
+  return simplified_.load(std::memory_order_relaxed);
+}
+
+/// Whether an ADD has a constant term or a MULTIPLY has a coefficient,
+/// stored in value_ instead of as a CONST operand.
+bool Symbol::Impl_::Exp::hasCoefficient() const {
+  return (Operator::ADD == operator_ || Operator::MULTIPLY == operator_) &&
+    identity(operator_) != value_;
+}
+
+/// Coefficient of ADD or MULTIPLY which does not change its value.
+double Symbol::Impl_::Exp::identity(const Operator oprtr) {
+  switch(oprtr) {
+  case Operator::ADD:
+    return 0.0;
+  case Operator::MULTIPLY:
+    return 1.0;
+  default:
+    return NAN;
+  }
+}
+
+bool Symbol::Impl_::Exp::isPositive() const {
+  return isConst() && !isZero() && value() > 0.0;
+}
+
+bool Symbol::Impl_::Exp::isNegative() const {
+  return isConst() && !isZero() && value() < 0.0;
+}
+
+template<typename... Args>
+Symbol::pExp Symbol::Impl_::makeExp(Args&&... args) {
+  chargeNode();
+  ArenaAllocator<Exp> allocator;
+  Exp* e = allocator.allocate(1);
+  try {
+    new (e) Exp(std::forward<Args>(args)...);
+  } catch (...) {
+    allocator.deallocate(e, 1);
+    throw;
+  }
+  e->arena_ = allocator.arena_;
+  return pExp(e);
+}
+
+Symbol::pExp Symbol::Impl_::constructOne() {
+  return constructCONST(1);
+}
+
+Symbol::pExp Symbol::Impl_::constructZero() {
+  return constructCONST(0);
+}
+
+Symbol::pExp Symbol::Impl_::constructCONST(const double c) {
+  if (auto cached = ConstantTable::instance().find(c)) {
+    return *cached;
+  }
+  auto& table = UniqueTable::instance();
+  if (!table.isEnabled()) {
+    return MAKE_SHARED_EXP(c);
+  }
+  auto e = table.find(Operator::CONST, c, {});
+  if (!e) {
+    e = MAKE_SHARED_EXP(c);
+    table.insert(e);
+  }
+  return e;
+}
+
+Symbol::pExp Symbol::Impl_::constructVARIABLE(const std::string name) {
+  return MAKE_SHARED_EXP(name);
+}
+
+Symbol::pExp Symbol::Impl_::constructVARIABLE(const std::string name, const double c) {
+  return MAKE_SHARED_EXP(name, c);
+}
+
+Symbol::pExp Symbol::Impl_::constructNEGATE(const Operand v) {
+  return constructOperation(Operator::NEGATE, {v});
+}
+
+Symbol::pExp Symbol::Impl_::constructADD(const Operands ops) {
+  switch(ops.size()) {
+  case 0:
+    return constructZero();
+  case 1:
+    return ops[0];
+  default:
+    return constructOperation(Operator::ADD, ops);
+  }
+}
+
+Symbol::pExp Symbol::Impl_::constructMULTIPLY(const Operands ops) {
+  switch(ops.size()) {
+  case 0:
+    return constructOne();
+  case 1:
+    return ops[0];
+  default:
+    return constructOperation(Operator::MULTIPLY, ops);
+  }
+}
+
+Symbol::pExp Symbol::Impl_::constructADD(const Operands ops, const double constant) {
+  if (0.0 == constant) {
+    return constructADD(ops);
+  } else if (ops.empty()) {
+    return constructCONST(constant);
+  }
+  return constructOperation(Operator::ADD, ops, constant);
+}
+
+Symbol::pExp Symbol::Impl_::constructMULTIPLY(const Operands ops, const double coefficient) {
+  if (1.0 == coefficient) {
+    return constructMULTIPLY(ops);
+  } else if (0.0 == coefficient) {
+    return constructZero();
+  } else if (ops.empty()) {
+    return constructCONST(coefficient);
+  }
+  return constructOperation(Operator::MULTIPLY, ops, coefficient);
+}
+
+Symbol::pExp Symbol::Impl_::constructPOWER(const Operands ops) {
+  return constructOperation(Operator::POWER, ops);
+}
+
+Symbol::pExp Symbol::Impl_::constructInverse(const Operand o) {
+  return constructPOWER({o, constructCONST(-1)});
+}
+
+Symbol::pExp Symbol::Impl_::constructLOG(const Operand v) {
+  return constructOperation(Operator::LOG, {v});
+}
+
+Symbol::pExp Symbol::Impl_::constructOperation(const Operator oprtr, const Operands ops) {
+  return constructOperation(oprtr, ops, Exp::identity(oprtr));
+}
+
+Symbol::pExp Symbol::Impl_::constructOperation
+(const Operator oprtr, const Operands ops, const double coefficient) {
+  auto& table = UniqueTable::instance();
+  if (!table.isEnabled()) {
+    return MAKE_SHARED_EXP(oprtr, ops, coefficient);
+  }
+  auto e = table.find(oprtr, coefficient, ops);
+  if (!e) {
+    e = MAKE_SHARED_EXP(oprtr, ops, coefficient);
+    table.insert(e);
+  }
+  return e;
+}
+
+/// Operands with the coefficient as a leading CONST operand,
+/// for the passes which handle all the operands alike.
+Symbol::Operands Symbol::Impl_::allOperands(const pExp& e) {
+  if (!e->hasCoefficient()) {
+    return e->operands_;
+  }
+  Operands ret {constructCONST(e->value_)};
+  ret.insert(ret.end(), e->operands_.begin(), e->operands_.end());
+  return ret;
+}
+
+Symbol::pExp Symbol::Impl_::flatten(const pExp e) {
+  switch(e->operator_) {
+  case Operator::NEGATE:
+    return flattenNEGATE(e);
+  case Operator::ADD:
+  case Operator::MULTIPLY:
+    return flattenMultiOperands(e);
+  default:
+    return e;
+  }
 }
 
 /// -(-X) -> X
@@ -862,389 +2620,1985 @@ Symbol::pExp Symbol::Impl_::flattenNEGATE(pExp e) {
   if (Operator::NEGATE != e->operator_) {
     LOG_AND_THROW("flattenNEGATE called on non-NEGATE expression.");
   }
-  Operand innerOperand = e->operands_[0];
-  switch (innerOperand->operator_) {
+  Operand innerOperand = e->operands_[0];
+  switch (innerOperand->operator_) {
+  case Operator::NEGATE:
+    return innerOperand->operands_[0];
+  case Operator::CONST:
+    return constructCONST(-innerOperand->value());
+  default:
+    return e;
+  }
+}
+
+/// ((X + Y) + Z) -> (X + Y + Z)
+/// (X * (Y * Z)) -> (X * Y * Z)
+Symbol::pExp Symbol::Impl_::flattenMultiOperands(pExp e) {
+  if (Operator::ADD != e->operator_ &&
+      Operator::MULTIPLY != e->operator_) {
+    LOG_AND_THROW("flattenMultiOperands must be called on ADD or MULTIPLY Expression.");
+  }
+  auto isNested = [&e](const Operand& operand_) {
+    return operand_->operator_ == e->operator_;
+  };
+  if (std::none_of(e->operands_.begin(), e->operands_.end(), isNested)) {
+    return e;
+  }
+  Operands newOperands;
+  double coefficient = e->value_;
+  for (auto& operand_ : e->operands_) {
+    if (operand_->operator_ != e->operator_) {
+      newOperands.push_back(operand_);
+    } else {
+      newOperands.insert(newOperands.end(),
+                         operand_->operands_.begin(),
+                         operand_->operands_.end());
+      if (Operator::ADD == e->operator_) {
+        coefficient += operand_->value_;
+      } else {
+        coefficient *= operand_->value_;
+      }
+    }
+  }
+  if (Operator::ADD == e->operator_) {
+    return constructADD(newOperands, coefficient);
+  }
+  return constructMULTIPLY(newOperands, coefficient);
+}
+
+Symbol::pExp Symbol::Impl_::sort(pExp e) {
+  if (Operator::POWER == e->operator_ ||
+      std::is_sorted(e->operands_.begin(), e->operands_.end(), compareOperands())) {
+    return e;
+  }
+  // Expressions are shared, so sort a copy instead of the operands in place.
+  Operands operands = e->operands_;
+  std::sort(operands.begin(), operands.end(), compareOperands());
+  return constructOperation(e->operator_, operands, e->value_);
+}
+
+Symbol::pExp Symbol::Impl_::expand(pExp e) {
+  switch(e->operator_) {
+  case Operator::NEGATE:
+    return expandNEGATE(e);
+  case Operator::MULTIPLY:
+    return expandMULTIPLY(e);
+  case Operator::POWER:
+    return expandPOWER(e);
+  case Operator::LOG:
+    return expandLOG(e);
+  default:
+    return e;
+  }
+}
+
+/// -(X + Y + Z) -> -X -Y -Z
+Symbol::pExp Symbol::Impl_::expandNEGATE(pExp e) {
+  if (Operator::NEGATE != e->operator_) {
+    LOG_AND_THROW("expandNEGATE was called on non-NEGATE Expression.");
+  }
+  auto innerOperand = e->operands_[0];
+  auto innerOperator = innerOperand->operator_;
+  switch(innerOperator) {
+  case Operator::ADD: {
+    Operands newOperands;
+    for (auto& operand_ : innerOperand->operands_) {
+      newOperands.push_back(constructNEGATE(operand_));
+    }
+    return constructADD(newOperands, -innerOperand->value_);
+  }
+  default:
+    return e;
+  }
+}
+
+/// (X + Y) * (A + B)  -> X*A + X*B + Y*A + Y*B
+Symbol::pExp Symbol::Impl_::expandMULTIPLY(pExp e) {
+  if (Operator::MULTIPLY != e->operator_) {
+    LOG_AND_THROW("expandMULTIPLY was called on non-MULTIPLY Expression.");
+  }
+  // Classify operands to ADD type and non-ADD type.
+  Operands nonAddOperands;
+  std::vector<Operands> addOperandsSet;
+  if (e->hasCoefficient()) {
+    nonAddOperands.push_back(constructCONST(e->value_));
+  }
+  for (auto& operand_ : e->operands_) {
+    if (operand_->operator_ == Operator::ADD) {
+      addOperandsSet.push_back(allOperands(operand_));
+    } else {
+      nonAddOperands.push_back(operand_);
+    }
+  }
+  // If no operand is ADD type, then it's expanded.
+  if (0 == addOperandsSet.size()) {
+    return e;
+  }
+  if (!withinBudget(e)) {
+    return e;
+  }
+  if (auto ret = expandPolynomial(e)) {
+    return ret;
+  }
+  // nonAddOperands holds the terms expanded so far, so the non-ADD
+  // factors form a single term: X * Y * (A + B) -> X*Y*A + X*Y*B
+  if (1 < nonAddOperands.size()) {
+    nonAddOperands = {constructMULTIPLY(nonAddOperands)};
+  }
+  // If all the operands are ADD type, moeve one to nonAddOperands.
+  if (0 == nonAddOperands.size()) {
+    nonAddOperands = addOperandsSet.back();
+    addOperandsSet.pop_back();
+  }
+  // Expand ADD operands one by one onto nonAddOperands.
+  for (auto& addOperands : addOperandsSet) {
+    Operands newNonAddOperands;
+    for (auto& addOperand: addOperands) {
+      for (auto& nonAddOperand : nonAddOperands) {
+        auto newNonAddOperand = constructMULTIPLY({nonAddOperand, addOperand});
+        newNonAddOperands.push_back(newNonAddOperand);
+      }
+    }
+    nonAddOperands = newNonAddOperands;
+  }
+  // Reconstruct as addition.
+  return constructADD(nonAddOperands);
+}
+
+/// (X * Y) ^ A -> (X ^ A) * (Y ^ A)
+Symbol::pExp Symbol::Impl_::expandPOWER(pExp e) {
+  if (Operator::POWER != e->operator_) {
+    LOG_AND_THROW("expandPOWER was called on non-POWER Expression.");
+  }
+  auto base = e->operands_[0];
+  auto expo = e->operands_[1];
+  if (Operator::MULTIPLY == base->operator_) {
+      Operands operands;
+      for (auto& operand_ : allOperands(base)) {
+        operands.push_back(constructPOWER({operand_, expo}));
+      }
+      return constructMULTIPLY(operands);
+  }
+  if (Operator::CONST == expo->operator_) {
+    double dExpo = expo->value();
+    if (dExpo > 0 && isInteger(dExpo) && Operator::ADD == base->operator_) {
+      if (!withinBudget(e)) {
+        return e;
+      }
+      if (auto ret = expandPolynomial(e)) {
+        return ret;
+      }
+    }
+    if (dExpo > 0 && isInteger(dExpo)) {
+      uint32_t iExpo = std::round(dExpo);
+      Operands operands;
+      for (uint32_t i = 0; i < iExpo; ++i) {
+        auto operand = base;
+          operands.push_back(operand);
+      }
+      return constructMULTIPLY(operands);
+    }
+  }
+  return e;
+}
+
+/// Expand products and powers of sums as polynomials, instead of building
+/// every cross product as a node and merging them afterwards.
+/// Returns null when a degree is too large to be packed, and e itself
+/// when the time of a Budget runs out during the expansion.
+Symbol::pExp Symbol::Impl_::expandPolynomial(pExp e) {
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  for (auto budget = Budget::current(); budget; budget = budget->previous_) {
+    deadline = std::min(deadline, budget->deadline_);
+  }
+  Polynomial::Deadline scope(deadline);
+  PolynomialRing ring(e);
+  Polynomial p(ring.size());
+  try {
+    if (!ring.toPolynomial(e, p)) {
+      return pExp();
+    }
+  } catch (const Polynomial::Expired&) {
+    // Refused now that the time has run out, or thrown in ABORT mode.
+    withinBudget(e);
+    return e;
+  }
+  return ring.toExp(p);
+}
+
+/// Upper bound of the number of terms of the expansion, without expanding.
+/// (t0 + ... + tk-1) ^ n has at most binomial(n + k - 1, n) terms.
+double Symbol::Impl_::predictTerms(const pExp& e) {
+  switch(e->operator_) {
   case Operator::NEGATE:
-    return innerOperand->operands_[0];
+    return predictTerms(e->operands_[0]);
+  case Operator::ADD: {
+    double terms = e->hasCoefficient() ? 1 : 0;
+    for (auto& operand : e->operands_) {
+      terms += predictTerms(operand);
+    }
+    return terms;
+  }
+  case Operator::MULTIPLY: {
+    double terms = 1;
+    for (auto& operand : e->operands_) {
+      terms *= predictTerms(operand);
+    }
+    return terms;
+  }
+  case Operator::POWER: {
+    auto expo = e->operands_[1];
+    if (!expo->isConst() || expo->value_ <= 0 || !isInteger(expo->value_)) {
+      return 1;
+    }
+    double n = std::round(expo->value_);
+    double k = predictTerms(e->operands_[0]);
+    // binomial(n + k - 1, n) == binomial(n + k - 1, k - 1)
+    double r = std::max(n, k - 1), m = std::min(n, k - 1);
+    double terms = 1;
+    for (double i = 1; i <= m && terms < INFINITY; ++i) {
+      terms = terms * (r + i) / i;
+    }
+    return std::round(terms);
+  }
+  default:
+    return 1;
+  }
+}
+
+/// Whether every Budget in scope allows expanding e now.
+/// An earlier refusal does not refuse the later expansions by itself.
+/// Throws instead of refusing in ABORT mode.
+bool Symbol::Impl_::withinBudget(const pExp& e) {
+  bool within = true;
+  // Predicted once, when a Budget limits the terms.
+  double terms = -1;
+  for (auto budget = Budget::current(); budget; budget = budget->previous_) {
+    const char* message = nullptr;
+    if (budget->nodes_ > budget->maxNodes_) {
+      message = "Node budget exceeded.";
+    } else if (budget->expired()) {
+      message = "Time budget exceeded.";
+    } else if (SIZE_MAX != budget->maxTerms_) {
+      if (terms < 0) {
+        terms = predictTerms(e);
+      }
+      if (terms > budget->maxTerms_) {
+        message = "Term budget exceeded.";
+      }
+    }
+    if (message) {
+      budget->exceed(message);
+      within = false;
+    }
+  }
+  if (!within) {
+    ++refusals();
+  }
+  return within;
+}
+
+/// Number of expansions refused by a Budget on this thread.
+/// simplify does not mark a result holding a refused expansion as
+/// simplified, so that it is expanded again once the Budget is gone.
+size_t& Symbol::Impl_::refusals() {
+  static thread_local size_t count = 0;
+  return count;
+}
+
+/// Count a node allocation against every Budget in scope.
+/// The clock is read every 256 nodes.
+void Symbol::Impl_::chargeNode() {
+  for (auto budget = Budget::current(); budget; budget = budget->previous_) {
+    ++budget->nodes_;
+    if (Budget::Mode::ABORT != budget->mode_) {
+      continue;
+    }
+    if (budget->nodes_ > budget->maxNodes_) {
+      budget->exceed("Node budget exceeded.");
+    } else if (0 == budget->nodes_ % 256 && budget->expired()) {
+      budget->exceed("Time budget exceeded.");
+    }
+  }
+}
+
+/// log(X * Y) -> log(X) + log(Y)
+/// log(X ^ Y) -> Y * log(X)
+Symbol::pExp Symbol::Impl_::expandLOG(pExp e) {
+  auto innerOperand = e->operands_[0];
+  switch(innerOperand->operator_) {
+  case Operator::MULTIPLY: {
+    Operands operands;
+    for (auto& operand : allOperands(innerOperand)) {
+      operands.push_back(constructLOG(operand));
+    }
+    return constructADD(operands);
+  }
+  case Operator::POWER:
+    return constructMULTIPLY({innerOperand->operands_[1],
+          constructLOG(innerOperand->operands_[0])});
+  default:
+    return e;
+  }
+}
+
+/// Returns e itself when merging does not change its structure,
+/// so that callers can detect the fixpoint by pointer comparison.
+Symbol::pExp Symbol::Impl_::merge(pExp e) {
+  pExp ret;
+  switch(e->operator_) {
+  case Operator::ADD:
+    ret = mergeADD(e);
+    break;
+  case Operator::MULTIPLY:
+    ret = mergeMULTIPLY(e);
+    break;
+  case Operator::POWER:
+    ret = mergePOWER(e);
+    break;
+  case Operator::LOG:
+    ret = mergeLOG(e);
+    break;
+  default:
+    return e;
+  }
+  return isSame(ret, e) ? e : ret;
+}
+
+/// Merge constant terms and the coefficients of non-constant terms
+/// ex) C1 + X + X + Y + C2 -> (2 * X) + Y + (C1 + C2)
+Symbol::pExp Symbol::Impl_::mergeADD(pExp e) {
+  if (Operator::ADD != e->operator_) {
+    LOG_AND_THROW("mergeADD was called ont non ADD Expression.");
+  }
+  std::unordered_map<pExp, double, hashOperand, equalTerm> operandCounts;
+  // Classify operands to coefficient and non-coefficient parts
+  double constTerm = e->value_;
+  for (auto& operand_ : e->operands_) {
+    if (operand_->isConst()) {
+      constTerm += operand_->value();
+    } else {
+      auto elems = decompose2(operand_);
+      operandCounts[elems.term_] += elems.coeff_;
+    }
+  }
+  // Like terms are collected by hash, then sorted once.
+  std::vector<std::pair<pExp, double>> entries(operandCounts.begin(), operandCounts.end());
+  std::sort(entries.begin(), entries.end(),
+            [](const std::pair<pExp, double>& e1, const std::pair<pExp, double>& e2) {
+              return compare(*e1.first, *e2.first) < 0;
+            });
+  // Reconstruct Expression
+  Operands operands;
+  for (auto& entry : entries) {
+    if (isNearlyEqual(entry.second, 0.0)) {
+      // coeff == 0: X - X -> 0
+      continue;
+    }
+    operands.push_back(scaleTerm(entry.first, entry.second));
+  }
+  return constructADD(operands, isNearlyEqual(constTerm, 0.0) ? 0.0 : constTerm);
+}
+
+/// Term of ADD with the given coefficient.
+/// Terms are compared up to their coefficient, so it is replaced.
+Symbol::pExp Symbol::Impl_::scaleTerm(const pExp& term, const double coeff) {
+  Operands factors = Operator::MULTIPLY == term->operator_ ? term->operands_ : Operands {term};
+  if (isNearlyEqual(coeff, 1.0)) {
+    // coeff == 1: X + X - X -> X
+    return constructMULTIPLY(factors);
+  } else if (isNearlyEqual(coeff, -1.0)) {
+    // coeff == -1: X - X - X -> - X
+    return constructNEGATE(constructMULTIPLY(factors));
+  }
+  // coeff * (X * Y) -> coeff * X * Y
+  return constructMULTIPLY(factors, coeff);
+}
+
+/// Plan adding a term to ADD through its term index, without changing
+/// the sum. The term is either merged into the like term or appended.
+void Symbol::Impl_::planTerm(const Exp* sum, const pExp& term, std::vector<OperandChange>& changes) {
+  auto& terms = *sum->terms_;
+  auto elems = decompose2(term);
+  auto it = terms.find(elems.term_);
+  if (it == terms.end()) {
+    changes.push_back({elems.term_, pExp(), term});
+    return;
+  }
+  auto coeff = decompose2(it->second).coeff_ + elems.coeff_;
+  if (isNearlyEqual(coeff, 0.0)) {
+    // X - X -> 0
+    changes.push_back({it->first, it->second, pExp()});
+    return;
+  }
+  changes.push_back({it->first, it->second, simplify(scaleTerm(it->first, coeff))});
+}
+
+/// Apply the changes planned for ADD or MULTIPLY in one step, keeping
+/// the operands in the canonical order so that reads never reorder them.
+/// Previous operands are found by binary search, and the new ones are
+/// sorted and merged with the rest in one pass. The hash is updated from
+/// the hashes of the changed operands. No node is allocated here, so a
+/// Budget which aborts while planning leaves e as it was.
+void Symbol::Impl_::commitChanges(Exp* e, const std::vector<OperandChange>& changes) {
+  if (changes.empty()) {
+    return;
+  }
+  auto& operands = e->operands_;
+  auto hash = e->hash_;
+  std::vector<bool> dropped(operands.size(), false);
+  size_t nDropped = 0;
+  Operands added;
+  for (auto& change : changes) {
+    if (change.previous_) {
+      auto it = std::lower_bound(operands.begin(), operands.end(),
+                                 change.previous_, compareOperands());
+      dropped[it - operands.begin()] = true;
+      ++nDropped;
+      hash -= Exp::mix(change.previous_->hash_);
+    }
+    if (change.operand_) {
+      added.push_back(change.operand_);
+      hash += Exp::mix(change.operand_->hash_);
+    }
+  }
+  std::sort(added.begin(), added.end(), compareOperands());
+  operands.reserve(operands.size() - nDropped + added.size());
+  // Nothing is changed before this point.
+  size_t kept = 0;
+  for (size_t i = 0; i < operands.size(); ++i) {
+    if (!dropped[i]) {
+      if (kept != i) {
+        operands[kept] = std::move(operands[i]);
+      }
+      ++kept;
+    }
+  }
+  while (operands.size() > kept) {
+    operands.pop_back();
+  }
+  for (auto& operand : added) {
+    operands.push_back(operand);
+  }
+  std::inplace_merge(operands.begin(), operands.begin() + kept, operands.end(),
+                     compareOperands());
+  auto& index = *e->terms_;
+  for (auto& change : changes) {
+    if (change.operand_) {
+      index[change.key_] = change.operand_;
+    } else {
+      index.erase(change.key_);
+    }
+  }
+  e->hash_ = hash;
+}
+
+/// Add simplified e to simplified ADD in place, looking up each term of e
+/// in expected O(1) and merging the changed terms in one pass, instead of
+/// merging all the terms again.
+/// Applicable only when the caller holds the only reference to the sum.
+/// The sum may be left with less than two terms, see Expression::operator +=.
+/// Every new term is built before the sum is changed, so the sum is left
+/// unchanged when building one throws.
+bool Symbol::Impl_::appendTerms(const pExp& sum, const pExp& e) {
+  auto s = sum.get();
+  if (Operator::ADD != s->operator_ || !s->isSimplified() || s->interned_ ||
+      1 != sum.use_count() || !e->isSimplified() || sum == e) {
+    return false;
+  }
+  if (!s->terms_) {
+    std::unique_ptr<TermIndex> terms(new TermIndex());
+    for (size_t i = 0; i < s->operands_.size(); ++i) {
+      (*terms)[decompose2(s->operands_[i]).term_] = s->operands_[i];
+    }
+    s->terms_ = std::move(terms);
+  }
+  double value = s->value_;
+  std::vector<OperandChange> changes;
+  switch(e->operator_) {
   case Operator::CONST:
-    return constructCONST(-innerOperand->value());
+    value += e->value_;
+    break;
+  case Operator::ADD:
+    value += e->value_;
+    for (auto& operand : e->operands_) {
+      planTerm(s, operand, changes);
+    }
+    break;
+  default:
+    planTerm(s, e, changes);
+  }
+  commitChanges(s, changes);
+  s->value_ = isNearlyEqual(value, 0.0) ? 0.0 : value;
+  return true;
+}
+
+/// Merge constant terms and the exponents of non-constant terms.
+/// ex) C1 * X * Y * X * C2 -> (C1 * C2) * (X ^ 2) * Y
+Symbol::pExp Symbol::Impl_::mergeMULTIPLY(pExp e) {
+  if (Operator::MULTIPLY != e->operator_) {
+    LOG_AND_THROW("mergeMULTIPLY was called on non-MULTIPLY Expression.");
+  }
+  // Numeric exponents are summed as numbers,
+  // the symbolic ones are collected and simplified once.
+  struct Exponent {
+    double numeric_;
+    Operands symbolic_;
+  };
+  double constOperand = e->value_;
+  std::unordered_map<pExp, Exponent, hashOperand, equalOperand> nonConstOperands;
+  // Classify operands to coefficient, base and exponent
+  for (auto& operand_ : e->operands_) {
+    auto elems = decompose3(operand_);
+    constOperand *= elems.coeff_;
+    if (!elems.base_) {
+      continue;
+    }
+    auto& entry = nonConstOperands[elems.base_];
+    if (!elems.expo_) {
+      entry.numeric_ += elems.numericExpo_;
+    } else {
+      entry.symbolic_.push_back(elems.expo_);
+    }
+  }
+  if (isNearlyEqual(constOperand, 0,0)) {
+    return constructZero();
+  }
+  // Reconstruct Expression.
+  Operands operands;
+  // Bases are collected by hash, then sorted once.
+  std::vector<std::pair<pExp, Exponent>> entries(nonConstOperands.begin(), nonConstOperands.end());
+  std::sort(entries.begin(), entries.end(),
+            [](const std::pair<pExp, Exponent>& e1, const std::pair<pExp, Exponent>& e2) {
+              return compare(*e1.first, *e2.first) < 0;
+            });
+  // Push back the other term
+  for (auto& entry : entries) {
+    auto power = constructPowerOf(entry.first, entry.second.numeric_, entry.second.symbolic_);
+    if (power) {
+      operands.push_back(power);
+    }
+  }
+  // The constant term is kept as the coefficient
+  return constructMULTIPLY(operands, isNearlyEqual(constOperand, 1.0) ? 1.0 : constOperand);
+}
+
+/// base ^ (numeric + symbolic[0] + symbolic[1] + ...)
+/// Returns null when the exponent is zero.
+Symbol::pExp Symbol::Impl_::constructPowerOf
+(const pExp& base, const double numeric, const Operands& symbolic) {
+  pExp exponent;
+  if (symbolic.empty()) {
+    exponent = constructCONST(numeric);
+  } else {
+    exponent = simplify(constructADD(symbolic, isNearlyEqual(numeric, 0.0) ? 0.0 : numeric));
+  }
+  if (exponent->isZero()) {
+    // exponent == 0: X ^ 0 -> 1
+    return pExp();
+  } else if (exponent->isOne()) {
+    // exponent == 1: X ^ 1 -> X
+    return base;
+  }
+  return constructPOWER({base, exponent});
+}
+
+/// Plan multiplying a factor to MULTIPLY through its base index, without
+/// changing the product. The exponent of the same base is updated, or the
+/// factor is appended, and its coefficient is multiplied to coeff.
+/// Returns false without planning anything when the result would
+/// not be a factor any more, as (X + 1) ^ Y * (X + 1) ^ (1 - Y).
+bool Symbol::Impl_::planFactor
+(const Exp* product, const pExp& factor, double& coeff, std::vector<OperandChange>& changes) {
+  auto elems = decompose3(factor);
+  if (!elems.base_) {
+    coeff *= elems.coeff_;
+    return true;
+  }
+  auto& bases = *product->terms_;
+  auto it = bases.find(elems.base_);
+  double numeric = 0;
+  Operands symbolic;
+  auto addExponent = [&numeric, &symbolic](const Decomposed3& d) {
+    if (d.expo_) {
+      symbolic.push_back(d.expo_);
+    } else {
+      numeric += d.numericExpo_;
+    }
+  };
+  addExponent(elems);
+  if (it != bases.end()) {
+    addExponent(decompose3(it->second));
+  }
+  auto power = constructPowerOf(elems.base_, numeric, symbolic);
+  if (power) {
+    power = simplify(power);
+    switch(power->operator_) {
+    case Operator::CONST:
+    case Operator::NEGATE:
+    case Operator::ADD:
+    case Operator::MULTIPLY:
+      return false;
+    default:
+      break;
+    }
+  }
+  coeff *= elems.coeff_;
+  if (it == bases.end()) {
+    if (power) {
+      changes.push_back({elems.base_, pExp(), power});
+    }
+    return true;
+  }
+  // X ^ Y * X ^ (-Y) -> 1 when power is null
+  changes.push_back({it->first, it->second, power});
+  return true;
+}
+
+/// Multiply simplified e to simplified MULTIPLY in place, looking up each
+/// factor of e in expected O(1). Factors which cannot be multiplied in place are
+/// returned in rest. Applicable only when the caller holds the only
+/// reference to the product and e is not ADD, which needs expansion.
+/// The product may be left with less than two factors,
+/// see Expression::operator *=.
+/// Every new factor is built before the product is changed, so the
+/// product is left unchanged when building one throws.
+bool Symbol::Impl_::appendFactors(const pExp& product, const pExp& e, Operands& rest) {
+  auto p = product.get();
+  if (Operator::MULTIPLY != p->operator_ || !p->isSimplified() || p->interned_ ||
+      1 != product.use_count() || !e->isSimplified() || product == e ||
+      Operator::ADD == e->operator_) {
+    return false;
+  }
+  if (!p->terms_) {
+    std::unique_ptr<TermIndex> bases(new TermIndex());
+    for (size_t i = 0; i < p->operands_.size(); ++i) {
+      (*bases)[decompose3(p->operands_[i]).base_] = p->operands_[i];
+    }
+    p->terms_ = std::move(bases);
+  }
+  double coeff = p->value_;
+  std::vector<OperandChange> changes;
+  Operands rejected;
+  if (Operator::MULTIPLY == e->operator_) {
+    coeff *= e->value_;
+    for (auto& operand : e->operands_) {
+      if (!planFactor(p, operand, coeff, changes)) {
+        rejected.push_back(operand);
+      }
+    }
+  } else if (!planFactor(p, e, coeff, changes)) {
+    rejected.push_back(e);
+  }
+  commitChanges(p, changes);
+  p->value_ = isNearlyEqual(coeff, 1.0) ? 1.0 : coeff;
+  rest.insert(rest.end(), rejected.begin(), rejected.end());
+  return true;
+}
+
+/// Merger POWER expression
+/// ex)
+///   C1 ^ C2 -> C3
+///   1 ^ X -> 1
+///   X ^ 0 -> 1
+///   X ^ 1 -> X
+Symbol::pExp Symbol::Impl_::mergePOWER(pExp e) {
+  if (Operator::POWER != e->operator_) {
+    LOG_AND_THROW("mergePOWER called on non-POWER Expression.");
+  }
+  auto base = e->operands_[0];
+  auto expo = e->operands_[1];
+  if (base->isConst() && expo->isConst()) {
+    return constructCONST(std::pow(base->value(), expo->value()));
+  }
+  if (base->isOne() || expo->isZero()) {
+    return constructOne();
+  }
+  if (expo->isOne()) {
+    return base;
+  }
+  return e;
+}
+
+/// log(1) -> 0
+Symbol::pExp Symbol::Impl_::mergeLOG(pExp e) {
+  if (Operator::LOG != e->operator_) {
+    LOG_AND_THROW("mergeLOG called on non-LOG Expression.");
+  }
+  if (e->operands_[0]->isOne()) {
+    return constructZero();
+  } else {
+    return e;
+  }
+}
+
+/// Decompose an Expression into coefficient and non-coefficient part
+/// such that pExp == coeff * non-coeff
+/// This function is made for simplifying the mergeADD.
+/// This decomposition is not necessarily generally apprecable.
+/// Operands are borrowed, so no node is allocated
+/// unless a MULTIPLY has to be split.
+Symbol::Impl_::Decomposed2 Symbol::Impl_::decompose2(const Operand& o) {
+  switch (o->operator_) {
+  case Operator::CONST:
+    return {o->value_, pExp()};
+  case Operator::ADD:
+  case Operator::POWER:
+  case Operator::VARIABLE:
+  case Operator::LOG:
+    return {1.0, o};
+  case Operator::NEGATE: {
+    auto ret = decompose2(o->operands_[0]);
+    ret.coeff_ = -ret.coeff_;
+    return ret;
+  }
+  case Operator::MULTIPLY: {
+    // Simplified MULTIPLY keeps the coefficient in its field,
+    // which is read without scanning the operands.
+    double constant = o->value_;
+    size_t nConst = 0;
+    if (!o->isSimplified()) {
+      for (auto& operand : o->operands_) {
+        if (operand->isConst()) {
+          constant *= operand->value_;
+          ++nConst;
+        }
+      }
+    }
+    if (0 == nConst) {
+      if (1 == o->operands_.size()) {
+        return {constant, o->operands_[0]};
+      }
+      // The term still carries the coefficient, see equalTerm.
+      return {constant, o};
+    }
+    Operands operands;
+    for (auto& operand : o->operands_) {
+      if (!operand->isConst()) {
+        operands.push_back(operand);
+      }
+    }
+    return {constant, constructMULTIPLY(operands)};
+  }
+  }
+  return {1.0, o};
+};
+
+/// Decompose an Expression into coefficient, base and exponent
+/// so that pExp == coeff * (base ^ expo)
+/// This function is made for simplifying the mergeMULTIPLY.
+/// This decomposition is not necessarily generally apprecable.
+Symbol::Impl_::Decomposed3 Symbol::Impl_::decompose3(const Operand& o) {
+  switch (o->operator_) {
+  case Operator::CONST:
+    return {o->value_, pExp(), pExp(), 0.0};
+  case Operator::NEGATE: {
+    auto ret = decompose3(o->operands_[0]);
+    ret.coeff_ = -ret.coeff_;
+    return ret;
+  }
+  case Operator::MULTIPLY: {
+    auto ret = decompose2(o);
+    auto base = ret.term_;
+    if (base->hasCoefficient()) {
+      base = constructMULTIPLY(base->operands_);
+    }
+    return {ret.coeff_, base, pExp(), 1.0};
+  }
+  case Operator::POWER: {
+    auto& expo = o->operands_[1];
+    if (expo->isConst()) {
+      return {1.0, o->operands_[0], pExp(), expo->value_};
+    }
+    return {1.0, o->operands_[0], expo, 0.0};
+  }
   default:
-    return e;
+    return {1.0, o, pExp(), 1.0};
   }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+Symbol::Impl_::Polynomial::Polynomial(size_t nVariables)
+  : words_(words(nVariables))
+  , exponents_()
+  , coeffs_()
+  , degree_(0)
+{}
+
+size_t Symbol::Impl_::Polynomial::words(size_t nVariables) {
+  return std::max<size_t>(1, (nVariables + VARIABLES_PER_WORD - 1) / VARIABLES_PER_WORD);
 }
 
-/// ((X + Y) + Z) -> (X + Y + Z)
-/// (X * (Y * Z)) -> (X * Y * Z)
-Symbol::pExp Symbol::Impl_::flattenMultiOperands(pExp e) {
-  if (Operator::ADD != e->operator_ &&
-      Operator::MULTIPLY != e->operator_) {
-    LOG_AND_THROW("flattenMultiOperands must be called on ADD or MULTIPLY Expression.");
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::constant(size_t nVariables, double c) {
+  Polynomial ret(nVariables);
+  if (!isNearlyEqual(c, 0.0)) {
+    std::vector<uint64_t> zero(ret.words_, 0);
+    ret.push(zero.data(), c);
   }
-  Operands newOperands;
-  for (auto& operand_ : e->operands_) {
-    if (operand_->operator_ != e->operator_) {
-      newOperands.push_back(operand_);
+  return ret;
+}
+
+/// Variables are packed from the most significant bits,
+/// so that the first variable is the most significant in the order.
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::variable(size_t nVariables, size_t index) {
+  Polynomial ret(nVariables);
+  std::vector<uint64_t> m(ret.words_, 0);
+  auto shift = 64 - BITS * (index % VARIABLES_PER_WORD + 1);
+  m[index / VARIABLES_PER_WORD] = uint64_t(1) << shift;
+  ret.push(m.data(), 1.0);
+  ret.degree_ = 1;
+  return ret;
+}
+
+size_t Symbol::Impl_::Polynomial::size() const {
+  return coeffs_.size();
+}
+
+uint32_t Symbol::Impl_::Polynomial::degree() const {
+  return degree_;
+}
+
+double Symbol::Impl_::Polynomial::coefficient(size_t i) const {
+  return coeffs_[i];
+}
+
+uint32_t Symbol::Impl_::Polynomial::exponent(size_t i, size_t variable) const {
+  return exponentOf(monomial(i), variable);
+}
+
+uint32_t Symbol::Impl_::Polynomial::exponentOf(const uint64_t* m, size_t variable) {
+  auto shift = 64 - BITS * (variable % VARIABLES_PER_WORD + 1);
+  return (m[variable / VARIABLES_PER_WORD] >> shift) & MAX_DEGREE;
+}
+
+const uint64_t* Symbol::Impl_::Polynomial::monomial(size_t i) const {
+  return &exponents_[i * words_];
+}
+
+/// Append a term, which must not precede the last one.
+/// Combined with the last term when their monomials are the same.
+void Symbol::Impl_::Polynomial::push(const uint64_t* m, double coeff) {
+  if (!coeffs_.empty() && 0 == compare(monomial(size() - 1), m)) {
+    coeffs_.back() += coeff;
+    return;
+  }
+  // Cancelled terms are removed before pushing the next one.
+  if (!coeffs_.empty() && isNearlyEqual(coeffs_.back(), 0.0)) {
+    coeffs_.back() = coeff;
+    std::copy(m, m + words_, exponents_.end() - words_);
+    return;
+  }
+  exponents_.insert(exponents_.end(), m, m + words_);
+  coeffs_.push_back(coeff);
+}
+
+/// Drop the last term when it is cancelled.
+void Symbol::Impl_::Polynomial::dropCancelled() {
+  if (!coeffs_.empty() && isNearlyEqual(coeffs_.back(), 0.0)) {
+    coeffs_.pop_back();
+    exponents_.resize(exponents_.size() - words_);
+  }
+}
+
+int Symbol::Impl_::Polynomial::compare(const uint64_t* m1, const uint64_t* m2) const {
+  for (size_t w = 0; w < words_; ++w) {
+    if (m1[w] != m2[w]) {
+      return m1[w] > m2[w] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::operator + (const Polynomial& other) const {
+  Polynomial ret(0);
+  ret.words_ = words_;
+  ret.degree_ = std::max(degree_, other.degree_);
+  size_t i = 0, j = 0;
+  while (i < size() || j < other.size()) {
+    if (j == other.size() || (i < size() && compare(monomial(i), other.monomial(j)) <= 0)) {
+      ret.push(monomial(i), coeffs_[i]);
+      ++i;
     } else {
-      newOperands.insert(newOperands.end(),
-                         operand_->operands_.begin(),
-                         operand_->operands_.end());
+      ret.push(other.monomial(j), other.coeffs_[j]);
+      ++j;
     }
   }
-  return MAKE_SHARED_EXP(e->operator_, newOperands);
+  ret.dropCancelled();
+  return ret;
 }
 
-Symbol::pExp Symbol::Impl_::sort(pExp e) {
-  if (Operator::POWER != e->operator_) {
-    std::sort(e->operands_.begin(), e->operands_.end(), compareOperands());
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::operator * (const Polynomial& other) const {
+  if (degree_ + other.degree_ > MAX_DEGREE) {
+    LOG_AND_THROW("Degree of Polynomial exceeds the maximum.");
   }
-  return e;
+  // Iterate the rows over the shorter polynomial.
+  if (size() > other.size()) {
+    return other * *this;
+  }
+  Polynomial ret(0);
+  ret.words_ = words_;
+  ret.degree_ = degree_ + other.degree_;
+  if (0 == size() || 0 == other.size()) {
+    return ret;
+  }
+  if (size() >= KARATSUBA_THRESHOLD && isDenseUnivariate() && other.isDenseUnivariate() &&
+      isKaratsubaAccurate(other)) {
+    return multiplyDense(other);
+  }
+  auto nThreads = std::min(threads(), size() * other.size() / PARALLEL_THRESHOLD);
+  if (nThreads > 1) {
+    return multiplyParallel(other, nThreads);
+  }
+  return multiplyHeap(other);
 }
 
-Symbol::pExp Symbol::Impl_::expand(pExp e) {
-  switch(e->operator_) {
-  case Operator::NEGATE:
-    return expandNEGATE(e);
-  case Operator::MULTIPLY:
-    return expandMULTIPLY(e);
-  case Operator::POWER:
-    return expandPOWER(e);
-  case Operator::LOG:
-    return expandLOG(e);
-  default:
-    return e;
+std::atomic<size_t>& Symbol::Impl_::Polynomial::threadCount() {
+  static std::atomic<size_t> count(std::max(1u, std::thread::hardware_concurrency()));
+  return count;
+}
+
+size_t Symbol::Impl_::Polynomial::threads() {
+  return threadCount().load(std::memory_order_relaxed);
+}
+
+/// Zero is taken as one thread.
+void Symbol::Impl_::Polynomial::setThreads(size_t n) {
+  threadCount().store(std::max<size_t>(1, n), std::memory_order_relaxed);
+}
+
+Symbol::Impl_::Polynomial::Deadline::Deadline(std::chrono::steady_clock::time_point at)
+  : previous_(current())
+{
+  current() = std::min(at, previous_);
+}
+
+Symbol::Impl_::Polynomial::Deadline::~Deadline() {
+  current() = previous_;
+}
+
+std::chrono::steady_clock::time_point& Symbol::Impl_::Polynomial::Deadline::current() {
+  static thread_local auto deadline = std::chrono::steady_clock::time_point::max();
+  return deadline;
+}
+
+void Symbol::Impl_::Polynomial::Deadline::check() {
+  auto deadline = current();
+  if (std::chrono::steady_clock::time_point::max() != deadline &&
+      std::chrono::steady_clock::now() > deadline) {
+    throw Expired();
   }
 }
 
-/// -(X + Y + Z) -> -X -Y -Z
-Symbol::pExp Symbol::Impl_::expandNEGATE(pExp e) {
-  if (Operator::NEGATE != e->operator_) {
-    LOG_AND_THROW("expandNEGATE was called on non-NEGATE Expression.");
+/// Terms in [begin, end).
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::slice(size_t begin, size_t end) const {
+  Polynomial ret(0);
+  ret.words_ = words_;
+  ret.degree_ = degree_;
+  ret.exponents_.assign(exponents_.begin() + begin * words_, exponents_.begin() + end * words_);
+  ret.coeffs_.assign(coeffs_.begin() + begin, coeffs_.begin() + end);
+  return ret;
+}
+
+Symbol::Impl_::WorkerPool::WorkerPool()
+  : mutex_()
+  , changed_()
+  , queue_()
+  , workers_()
+  , stopping_(false)
+{}
+
+Symbol::Impl_::WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
   }
-  auto innerOperand = e->operands_[0];
-  auto innerOperator = innerOperand->operator_;
-  switch(innerOperator) {
-  case Operator::ADD: {
-    Operands newOperands;
-    for (auto& operand_ : innerOperand->operands_) {
-      newOperands.push_back(constructNEGATE(operand_));
+  changed_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+Symbol::Impl_::WorkerPool& Symbol::Impl_::WorkerPool::instance() {
+  static WorkerPool pool;
+  return pool;
+}
+
+void Symbol::Impl_::WorkerPool::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    changed_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
     }
-    return MAKE_SHARED_EXP(innerOperator, newOperands);
+    auto task = std::move(queue_.back());
+    queue_.pop_back();
+    lock.unlock();
+    task();
+    lock.lock();
   }
-  default:
-    return e;
+}
+
+void Symbol::Impl_::WorkerPool::run
+(const std::vector<std::function<void()>>& tasks, size_t nThreads) {
+  if (nThreads < 2 || tasks.size() < 2) {
+    for (auto& task : tasks) {
+      task();
+    }
+    return;
+  }
+  size_t pending = tasks.size();
+  std::exception_ptr error;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (workers_.size() + 1 < nThreads) {
+    workers_.emplace_back([this]() { work(); });
+  }
+  for (auto& task : tasks) {
+    queue_.push_back([this, &task, &pending, &error]() {
+      std::exception_ptr thrown;
+      try {
+        task();
+      } catch (...) {
+        thrown = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (thrown && !error) {
+        error = thrown;
+      }
+      if (0 == --pending) {
+        changed_.notify_all();
+      }
+    });
+  }
+  changed_.notify_all();
+  while (pending) {
+    if (queue_.empty()) {
+      changed_.wait(lock);
+      continue;
+    }
+    auto task = std::move(queue_.back());
+    queue_.pop_back();
+    lock.unlock();
+    task();
+    lock.lock();
+  }
+  if (error) {
+    std::rethrow_exception(error);
   }
 }
 
-/// (X + Y) * (A + B)  -> X*A + X*B + Y*A + Y*B
-Symbol::pExp Symbol::Impl_::expandMULTIPLY(pExp e) {
-  if (Operator::MULTIPLY != e->operator_) {
-    LOG_AND_THROW("expandMULTIPLY was called on non-MULTIPLY Expression.");
+/// Multiply chunks of the other polynomial in parallel, and merge the
+/// partial products pairwise, also in parallel, on the WorkerPool.
+/// Polynomials share no state, so the tasks need no synchronization.
+/// The Deadline of the calling thread applies to the tasks.
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::multiplyParallel(const Polynomial& other,
+                                                                      size_t nThreads) const {
+  nThreads = std::min(nThreads, other.size());
+  std::vector<Polynomial> partials(nThreads, Polynomial(0));
+  std::vector<std::function<void()>> tasks;
+  auto deadline = Deadline::current();
+  for (size_t t = 0; t < nThreads; ++t) {
+    tasks.push_back([this, &other, &partials, t, nThreads, deadline]() {
+      Deadline scope(deadline);
+      auto begin = other.size() * t / nThreads;
+      auto end = other.size() * (t + 1) / nThreads;
+      partials[t] = multiplyHeap(other.slice(begin, end));
+    });
   }
-  // Classify operands to ADD type and non-ADD type.
-  Operands nonAddOperands;
-  std::vector<Operands> addOperandsSet;
-  for (auto& operand_ : e->operands_) {
-    if (operand_->operator_ == Operator::ADD) {
-      addOperandsSet.push_back(operand_->operands_);
-    } else {
-      nonAddOperands.push_back(operand_);
+  WorkerPool::instance().run(tasks, nThreads);
+  while (partials.size() > 1) {
+    std::vector<Polynomial> merged((partials.size() + 1) / 2, Polynomial(0));
+    tasks.clear();
+    for (size_t i = 0; i + 1 < partials.size(); i += 2) {
+      tasks.push_back([&partials, &merged, i]() {
+        merged[i / 2] = partials[i] + partials[i + 1];
+      });
     }
+    WorkerPool::instance().run(tasks, nThreads);
+    if (partials.size() % 2) {
+      merged.back() = std::move(partials.back());
+    }
+    partials.swap(merged);
   }
-  // If no operand is ADD type, then it's expanded.
-  if (0 == addOperandsSet.size()) {
-    return e;
+  partials[0].degree_ = degree_ + other.degree_;
+  return partials[0];
+}
+
+/// Johnson's heap multiplication, see PolynomialStream.
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::multiplyHeap(const Polynomial& other) const {
+  Polynomial ret(0);
+  ret.words_ = words_;
+  ret.degree_ = degree_ + other.degree_;
+  PolynomialStream stream(*this, other);
+  while (stream.next()) {
+    ret.push(stream.monomial(), stream.coefficient());
   }
-  // If all the operands are ADD type, moeve one to nonAddOperands.
-  if (0 == nonAddOperands.size()) {
-    nonAddOperands = addOperandsSet.back();
-    addOperandsSet.pop_back();
+  return ret;
+}
+
+/// Only the first variable appears, and at least half of the coefficients
+/// up to the degree are non-zero.
+bool Symbol::Impl_::Polynomial::isDenseUnivariate() const {
+  if (1 != words_ || coeffs_.empty()) {
+    return false;
   }
-  // Expand ADD operands one by one onto nonAddOperands.
-  for (auto& addOperands : addOperandsSet) {
-    Operands newNonAddOperands;
-    for (auto& addOperand: addOperands) {
-      for (auto& nonAddOperand : nonAddOperands) {
-        auto newNonAddOperand = constructMULTIPLY({nonAddOperand, addOperand});
-        newNonAddOperands.push_back(newNonAddOperand);
-      }
+  const uint64_t others = (uint64_t(1) << (64 - BITS)) - 1;
+  for (auto m : exponents_) {
+    if (m & others) {
+      return false;
     }
-    nonAddOperands = newNonAddOperands;
   }
-  // Reconstruct as addition.
-  return constructADD(nonAddOperands);
+  // Terms are in descending order, so the first one has the degree.
+  return 2 * size() > exponent(0, 0);
 }
 
-/// (X * Y) ^ A -> (X ^ A) * (Y ^ A)
-Symbol::pExp Symbol::Impl_::expandPOWER(pExp e) {
-  if (Operator::POWER != e->operator_) {
-    LOG_AND_THROW("expandPOWER was called on non-POWER Expression.");
+/// Karatsuba subtracts partial products, so its rounding error is relative
+/// to the norms of the operands rather than to each coefficient.
+/// It is exact for integer coefficients while the norms are small enough,
+/// otherwise the error must stay well below the tolerance of isNearlyEqual.
+bool Symbol::Impl_::Polynomial::isKaratsubaAccurate(const Polynomial& other) const {
+  double norm1 = 0, norm2 = 0;
+  bool integral = true;
+  for (auto c : coeffs_) {
+    norm1 += std::fabs(c);
+    integral = integral && c == std::round(c);
   }
-  auto base = e->operands_[0];
-  auto expo = e->operands_[1];
-  if (Operator::MULTIPLY == base->operator_) {
-      Operands operands;
-      for (auto& operand_ : base->operands_) {
-        operands.push_back(constructPOWER({operand_, expo}));
+  for (auto c : other.coeffs_) {
+    norm2 += std::fabs(c);
+    integral = integral && c == std::round(c);
+  }
+  auto bound = norm1 * norm2;
+  if (integral) {
+    return bound < 9007199254740992.0;  // 2 ^ 53
+  }
+  auto levels = std::log2(double(std::max(size(), other.size())));
+  return bound * levels * std::numeric_limits<double>::epsilon() < 1e-7;
+}
+
+/// Multiply univariate polynomials as dense coefficient vectors.
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::multiplyDense(const Polynomial& other) const {
+  auto n = std::max(exponent(0, 0), other.exponent(0, 0)) + 1;
+  std::vector<double> a(n, 0.0), b(n, 0.0), c(2 * n - 1, 0.0);
+  for (size_t i = 0; i < size(); ++i) {
+    a[exponent(i, 0)] = coeffs_[i];
+  }
+  for (size_t i = 0; i < other.size(); ++i) {
+    b[other.exponent(i, 0)] = other.coeffs_[i];
+  }
+  karatsuba(a.data(), b.data(), n, c.data());
+
+  Polynomial ret(0);
+  ret.words_ = words_;
+  ret.degree_ = degree_ + other.degree_;
+  for (size_t k = c.size(); k-- > 0;) {
+    if (!isNearlyEqual(c[k], 0.0)) {
+      uint64_t m = uint64_t(k) << (64 - BITS);
+      ret.push(&m, c[k]);
+    }
+  }
+  return ret;
+}
+
+/// Add the product of a and b, both of length n, to out of length 2n - 1.
+/// (a0 + a1 X) (b0 + b1 X) =
+///   a0 b0 + ((a0 + a1) (b0 + b1) - a0 b0 - a1 b1) X + a1 b1 X^2
+void Symbol::Impl_::Polynomial::karatsuba(const double* a, const double* b, size_t n, double* out) {
+  if (n <= KARATSUBA_THRESHOLD) {
+    for (size_t i = 0; i < n; ++i) {
+      for (size_t j = 0; j < n; ++j) {
+        out[i + j] += a[i] * b[j];
       }
-      return constructMULTIPLY(operands);
+    }
+    return;
   }
-  if (Operator::CONST == expo->operator_) {
-    double dExpo = expo->value();
-    if (dExpo > 0 && isInteger(dExpo)) {
-      uint32_t iExpo = std::round(dExpo);
-      Operands operands;
-      for (uint32_t i = 0; i < iExpo; ++i) {
-        auto operand = base;
-          operands.push_back(operand);
+  Deadline::check();
+  // The lower halves have h coefficients and the upper halves k >= h.
+  auto h = n / 2;
+  auto k = n - h;
+  std::vector<double> z0(2 * h - 1, 0.0), z1(2 * k - 1, 0.0), z2(2 * k - 1, 0.0);
+  std::vector<double> sa(a + h, a + n), sb(b + h, b + n);
+  for (size_t i = 0; i < h; ++i) {
+    sa[i] += a[i];
+    sb[i] += b[i];
+  }
+  karatsuba(a, b, h, z0.data());
+  karatsuba(a + h, b + h, k, z2.data());
+  karatsuba(sa.data(), sb.data(), k, z1.data());
+  for (size_t i = 0; i < z0.size(); ++i) {
+    out[i] += z0[i];
+    z1[i] -= z0[i];
+  }
+  for (size_t i = 0; i < z2.size(); ++i) {
+    out[i + 2 * h] += z2[i];
+    out[i + h] += z1[i] - z2[i];
+  }
+}
+
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::operator * (double c) const {
+  Polynomial ret(0);
+  ret.words_ = words_;
+  if (isNearlyEqual(c, 0.0)) {
+    return ret;
+  }
+  ret.exponents_ = exponents_;
+  ret.degree_ = degree_;
+  for (auto coeff : coeffs_) {
+    ret.coeffs_.push_back(coeff * c);
+  }
+  return ret;
+}
+
+/// No variable appears in more than one term, as in (a + b * c + 1).
+/// Then distinct multinomial terms of a power have distinct monomials.
+bool Symbol::Impl_::Polynomial::hasDisjointTerms() const {
+  std::vector<uint64_t> used(words_, 0);
+  for (size_t i = 0; i < size(); ++i) {
+    auto m = monomial(i);
+    for (size_t w = 0; w < words_; ++w) {
+      uint64_t fields = 0;
+      for (size_t v = 0; v < VARIABLES_PER_WORD; ++v) {
+        uint64_t field = uint64_t(MAX_DEGREE) << (v * BITS);
+        if (m[w] & field) {
+          fields |= field;
+        }
       }
-      return constructMULTIPLY(operands);
+      if (used[w] & fields) {
+        return false;
+      }
+      used[w] |= fields;
     }
   }
-  return e;
+  return true;
 }
 
-/// log(X * Y) -> log(X) + log(Y)
-/// log(X ^ Y) -> Y * log(X)
-Symbol::pExp Symbol::Impl_::expandLOG(pExp e) {
-  auto innerOperand = e->operands_[0];
-  switch(innerOperand->operator_) {
-  case Operator::MULTIPLY: {
-    Operands operands;
-    for (auto& operand : innerOperand->operands_) {
-      operands.push_back(constructLOG(operand));
+/// Power by the multinomial theorem when the terms are disjoint, so that
+/// every generated term is a term of the result.
+/// Otherwise by repeated squaring.
+Symbol::Impl_::Polynomial Symbol::Impl_::Polynomial::pow(uint32_t n) const {
+  if (uint64_t(degree_) * n > MAX_DEGREE) {
+    LOG_AND_THROW("Degree of Polynomial exceeds the maximum.");
+  }
+  Polynomial ret(0);
+  ret.words_ = words_;
+  if (0 == size() && n > 0) {
+    return ret;
+  }
+  if (n > 0 && hasDisjointTerms()) {
+    ret.degree_ = degree_ * n;
+    PolynomialStream stream(*this, n);
+    while (stream.next()) {
+      ret.push(stream.monomial(), stream.coefficient());
     }
-    return constructADD(operands);
+    return ret;
+  }
+  std::vector<uint64_t> zero(words_, 0);
+  ret.push(zero.data(), 1.0);
+  Polynomial square = *this;
+  while (n) {
+    if (n & 1) {
+      ret = ret * square;
+    }
+    n >>= 1;
+    if (n) {
+      square = square * square;
+    }
+  }
+  return ret;
+}
+
+Symbol::Impl_::PolynomialStream::PolynomialStream(const Polynomial& rows, const Polynomial& columns)
+  : mode_(Mode::PRODUCT)
+  , words_(rows.words_)
+  , rows_(rows.size() <= columns.size() ? rows : columns)
+  , columns_(rows.size() <= columns.size() ? columns : rows)
+  , cursors_(rows_.size(), 0)
+  , products_(rows_.size() * words_)
+  , heap_()
+  , n_(0)
+  , ks_()
+  , binomials_()
+  , powers_()
+  , factors_()
+  , indices_()
+  , weights_()
+  , free_()
+  , node_()
+  , parent_()
+  , next_()
+  , monomial_(words_)
+  , coeff_(0)
+  , steps_(0)
+{
+  if (rows_.size() && columns_.size()) {
+    pushRow(0);
+  }
+}
+
+/// The factors must not be empty.
+Symbol::Impl_::PolynomialStream::PolynomialStream(const std::vector<Polynomial>& factors)
+  : mode_(Mode::FACTORS)
+  , words_(factors.at(0).words_)
+  , rows_(0)
+  , columns_(0)
+  , cursors_()
+  , products_()
+  , heap_()
+  , n_(0)
+  , ks_()
+  , binomials_()
+  , powers_()
+  , factors_(factors)
+  , indices_()
+  , weights_()
+  , free_()
+  , node_(factors.size(), 0)
+  , parent_(words_)
+  , next_(words_, 0)
+  , monomial_(words_)
+  , coeff_(0)
+  , steps_(0)
+{
+  uint64_t degree = 0;
+  for (auto& factor : factors_) {
+    if (0 == factor.size()) {
+      return;
+    }
+    degree += factor.degree_;
+  }
+  if (degree > Polynomial::MAX_DEGREE) {
+    LOG_AND_THROW("Degree of Polynomial exceeds the maximum.");
+  }
+  // The product of the first terms
+  double coeff = 1.0;
+  for (auto& factor : factors_) {
+    auto m = factor.monomial(0);
+    for (size_t w = 0; w < words_; ++w) {
+      next_[w] += m[w];
+    }
+    coeff *= factor.coeffs_[0];
+  }
+  pushNode(next_.data(), coeff);
+}
+
+Symbol::Impl_::PolynomialStream::PolynomialStream(const Polynomial& base, uint32_t n)
+  : mode_(base.size() && base.hasDisjointTerms() ? Mode::MULTINOMIAL : Mode::POWER)
+  , words_(base.words_)
+  , rows_(base)
+  , columns_(0)
+  , cursors_()
+  , products_()
+  , heap_()
+  , n_(n)
+  , ks_()
+  , binomials_()
+  , powers_()
+  , factors_()
+  , indices_()
+  , weights_()
+  , free_()
+  , node_()
+  , parent_(words_)
+  , next_(words_, 0)
+  , monomial_(words_)
+  , coeff_(0)
+  , steps_(0)
+{
+  if (uint64_t(base.degree_) * n > Polynomial::MAX_DEGREE) {
+    LOG_AND_THROW("Degree of Polynomial exceeds the maximum.");
+  }
+  powers_.assign(base.size(), std::vector<double>(n + 1, 1.0));
+  for (size_t i = 0; i < base.size(); ++i) {
+    for (uint32_t k = 1; k <= n; ++k) {
+      powers_[i][k] = powers_[i][k - 1] * base.coeffs_[i];
+    }
+  }
+  if (Mode::MULTINOMIAL == mode_) {
+    return;
+  }
+  if (0 == base.size()) {
+    // 0 ^ 0 -> 1
+    if (0 == n) {
+      mode_ = Mode::FACTORS;
+      factors_.push_back(Polynomial(0));
+      factors_[0].words_ = words_;
+      factors_[0].push(next_.data(), 1.0);
+      node_.assign(1, 0);
+      pushNode(next_.data(), 1.0);
+    }
+    return;
+  }
+  // The power of the first term
+  factors_.push_back(base);
+  node_.assign(base.size(), 0);
+  node_[0] = n;
+  auto m = base.monomial(0);
+  for (size_t w = 0; w < words_; ++w) {
+    next_[w] = n * m[w];
+  }
+  pushNode(next_.data(), 1.0);
+}
+
+int Symbol::Impl_::PolynomialStream::compare(const uint64_t* m1, const uint64_t* m2) const {
+  for (size_t w = 0; w < words_; ++w) {
+    if (m1[w] != m2[w]) {
+      return m1[w] > m2[w] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/// Check the Deadline every POLL_INTERVAL calls.
+void Symbol::Impl_::PolynomialStream::poll() {
+  if (++steps_ == POLL_INTERVAL) {
+    steps_ = 0;
+    Polynomial::Deadline::check();
+  }
+}
+
+void Symbol::Impl_::PolynomialStream::pushHeap(size_t i) {
+  heap_.push_back(i);
+  std::push_heap(heap_.begin(), heap_.end(), [this](size_t i1, size_t i2) {
+    return compare(products_.data() + i1 * words_, products_.data() + i2 * words_) > 0;
+  });
+}
+
+size_t Symbol::Impl_::PolynomialStream::popHeap() {
+  std::pop_heap(heap_.begin(), heap_.end(), [this](size_t i1, size_t i2) {
+    return compare(products_.data() + i1 * words_, products_.data() + i2 * words_) > 0;
+  });
+  auto i = heap_.back();
+  heap_.pop_back();
+  return i;
+}
+
+void Symbol::Impl_::PolynomialStream::pushRow(size_t row) {
+  auto m1 = rows_.monomial(row);
+  auto m2 = columns_.monomial(cursors_[row]);
+  for (size_t w = 0; w < words_; ++w) {
+    products_[row * words_ + w] = m1[w] + m2[w];
+  }
+  pushHeap(row);
+}
+
+/// Move the row to its next column. The next row is started when the
+/// first product of this one is popped, which keeps the heap small.
+void Symbol::Impl_::PolynomialStream::advance(size_t row) {
+  if (0 == cursors_[row] && row + 1 < rows_.size()) {
+    pushRow(row + 1);
   }
-  case Operator::POWER:
-    return constructMULTIPLY({innerOperand->operands_[1],
-          constructLOG(innerOperand->operands_[0])});
-  default:
-    return e;
+  if (++cursors_[row] < columns_.size()) {
+    pushRow(row);
   }
 }
 
-Symbol::pExp Symbol::Impl_::merge(pExp e) {
-  switch(e->operator_) {
-  case Operator::ADD:
-    return mergeADD(e);
-  case Operator::MULTIPLY:
-    return mergeMULTIPLY(e);
-  case Operator::POWER:
-    return mergePOWER(e);
-  case Operator::LOG:
-    return mergeLOG(e);
-  default:
-    return e;
+bool Symbol::Impl_::PolynomialStream::nextProduct() {
+  while (!heap_.empty()) {
+    poll();
+    auto row = popHeap();
+    std::copy(products_.data() + row * words_, products_.data() + (row + 1) * words_,
+              monomial_.begin());
+    coeff_ = rows_.coeffs_[row] * columns_.coeffs_[cursors_[row]];
+    advance(row);
+    while (!heap_.empty() && 0 == compare(products_.data() + heap_[0] * words_, monomial_.data())) {
+      row = popHeap();
+      coeff_ += rows_.coeffs_[row] * columns_.coeffs_[cursors_[row]];
+      advance(row);
+    }
+    if (!isNearlyEqual(coeff_, 0.0)) {
+      return true;
+    }
   }
+  return false;
 }
 
-/// Merge constant terms and the coefficients of non-constant terms
-/// ex) C1 + X + X + Y + C2 -> (2 * X) + Y + (C1 + C2)
-Symbol::pExp Symbol::Impl_::mergeADD(pExp e) {
-  if (Operator::ADD != e->operator_) {
-    LOG_AND_THROW("mergeADD was called ont non ADD Expression.");
+/// Push node_ with its monomial into a free slot.
+void Symbol::Impl_::PolynomialStream::pushNode(const uint64_t* monomial, double weight) {
+  size_t slot;
+  if (free_.empty()) {
+    slot = weights_.size();
+    weights_.push_back(weight);
+    indices_.insert(indices_.end(), node_.begin(), node_.end());
+    products_.insert(products_.end(), monomial, monomial + words_);
+  } else {
+    slot = free_.back();
+    free_.pop_back();
+    weights_[slot] = weight;
+    std::copy(node_.begin(), node_.end(), indices_.begin() + slot * node_.size());
+    std::copy(monomial, monomial + words_, products_.begin() + slot * words_);
   }
-  std::map<pExp, double, compareOperands> operandCounts;
-  // Classify operands to coefficient and non-coefficient parts
-  auto constTerm = constructZero();
-  for (auto& operand_ : e->operands_) {
-    if (operand_->isConst()) {
-      *(constTerm->pVal_) += operand_->value();
-    } else {
-      auto elems = decompose2(operand_);
-      auto coeff = elems[0];
-      auto nonCoeff = elems[1];
-      operandCounts[nonCoeff] += coeff->value();
+  pushHeap(slot);
+}
+
+/// Pop the largest node into node_, push its successors,
+/// and return the coefficient of its product.
+///
+/// A node of a product is the index of a term in each factor. Its
+/// successors increment one index, from the last non-zero one onwards,
+/// so every node has one predecessor, where its last non-zero index is
+/// decremented. A node of a power is the exponent of each term of the base,
+/// summing to n. Its successors move one from the last non-zero exponent
+/// to the next term, or one from the term before it to the last one,
+/// so every node has one predecessor, where one is moved back from the
+/// last non-zero exponent. Terms are in the descending order, so no node
+/// precedes its predecessor, and the heap pops every node once in order.
+double Symbol::Impl_::PolynomialStream::popNode() {
+  auto slot = popHeap();
+  auto weight = weights_[slot];
+  std::copy(indices_.begin() + slot * node_.size(), indices_.begin() + (slot + 1) * node_.size(),
+            node_.begin());
+  std::copy(products_.data() + slot * words_, products_.data() + (slot + 1) * words_,
+            parent_.begin());
+  free_.push_back(slot);
+  size_t last = node_.size() - 1;
+  while (last && !node_[last]) {
+    --last;
+  }
+  if (Mode::FACTORS == mode_) {
+    for (size_t j = last; j < node_.size(); ++j) {
+      auto& factor = factors_[j];
+      auto i = node_[j];
+      if (i + 1 == factor.size()) {
+        continue;
+      }
+      auto m1 = factor.monomial(i), m2 = factor.monomial(i + 1);
+      for (size_t w = 0; w < words_; ++w) {
+        next_[w] = parent_[w] - m1[w] + m2[w];
+      }
+      ++node_[j];
+      double coeff = 1.0;
+      for (size_t k = 0; k < node_.size(); ++k) {
+        coeff *= factors_[k].coeffs_[node_[k]];
+      }
+      pushNode(next_.data(), coeff);
+      --node_[j];
     }
+    return weight;
   }
-  if (!constTerm->isZero()) {
-    operandCounts[constTerm] = 1;
+  auto& base = factors_[0];
+  double coeff = weight;
+  for (size_t i = 0; i <= last; ++i) {
+    coeff *= powers_[i][node_[i]];
   }
-  // Reconstruct Expression
-  Operands operands;
-  for (auto& entry : operandCounts) {
-    if (isNearlyEqual(entry.second, 0.0)) {
-      // coeff == 0: X - X -> 0
+  for (size_t q = std::max<size_t>(last, 1); q <= last + 1 && q < node_.size(); ++q) {
+    if (0 == node_[q - 1]) {
       continue;
-    } else if (isNearlyEqual(entry.second, 1.0)) {
-      // coeff == 1: X + X - X -> X
-      operands.push_back(entry.first);
-    } else if (isNearlyEqual(entry.second, -1.0)) {
-      // coeff == -1: X - X - X -> - X
-      operands.push_back(constructNEGATE(entry.first));
-    } else {
-      Operand coeff = constructCONST(entry.second);
-      operands.push_back(constructMULTIPLY({coeff, entry.first}));
     }
+    auto m1 = base.monomial(q - 1), m2 = base.monomial(q);
+    for (size_t w = 0; w < words_; ++w) {
+      next_[w] = parent_[w] - m1[w] + m2[w];
+    }
+    // n! / (k0! k1! ...) with one moved from k[q - 1] to k[q]
+    auto multinomial = weight * node_[q - 1] / (node_[q] + 1);
+    --node_[q - 1];
+    ++node_[q];
+    pushNode(next_.data(), multinomial);
+    ++node_[q - 1];
+    --node_[q];
   }
-  return constructADD(operands);
+  return coeff;
 }
 
-/// Merge constant terms and the exponents of non-constant terms.
-/// ex) C1 * X * Y * X * C2 -> (C1 * C2) * (X ^ 2) * Y
-Symbol::pExp Symbol::Impl_::mergeMULTIPLY(pExp e) {
-  if (Operator::MULTIPLY != e->operator_) {
-    LOG_AND_THROW("mergeMULTIPLY was called on non-MULTIPLY Expression.");
+/// Pop the nodes with the largest monomial and combine them.
+bool Symbol::Impl_::PolynomialStream::nextNode() {
+  while (!heap_.empty()) {
+    poll();
+    std::copy(products_.data() + heap_[0] * words_, products_.data() + (heap_[0] + 1) * words_,
+              monomial_.begin());
+    coeff_ = 0;
+    do {
+      coeff_ += popNode();
+    } while (!heap_.empty() && 0 == compare(products_.data() + heap_[0] * words_, monomial_.data()));
+    if (!isNearlyEqual(coeff_, 0.0)) {
+      return true;
+    }
   }
-  auto constOperand = constructOne();
-  std::map<pExp, pExp, compareOperands> nonConstOperands;
-  // Classify operands to coefficient, base and exponent
-  for (auto& operand_ : e->operands_) {
-    auto elems = decompose3(operand_);
-    auto coeff = elems[0]->value();
-    auto base = elems[1];
-    auto exponent = elems[2];
-    (*constOperand->pVal_) *= coeff;
-    if (nonConstOperands[base]) {
-      nonConstOperands[base] = nonConstOperands[base] + exponent;
+  return false;
+}
+
+/// (t0 + t1 + ...) ^ n = sum n! / (k0! k1! ...) * t0 ^ k0 * t1 ^ k1 * ...
+/// The exponents are enumerated in the descending lexicographic order,
+/// which is the order of the monomials for disjoint terms.
+bool Symbol::Impl_::PolynomialStream::nextMultinomial() {
+  auto m = rows_.size();
+  do {
+    poll();
+    if (ks_.empty()) {
+      ks_.assign(m, 0);
+      binomials_.assign(m, 1.0);
+      ks_[0] = n_;
     } else {
-      nonConstOperands[base] = exponent;
+      // The last term which can give its exponent to the following one
+      size_t i = m - 1;
+      do {
+        if (0 == i) {
+          return false;
+        }
+        --i;
+      } while (0 == ks_[i]);
+      uint32_t rest = 0;
+      for (size_t j = i + 1; j < m; ++j) {
+        rest += ks_[j];
+        ks_[j] = 0;
+        binomials_[j] = 1.0;
+      }
+      // binomial(r, k - 1) = binomial(r, k) * k / (r - k + 1)
+      auto k = ks_[i];
+      binomials_[i] = binomials_[i] * k / (rest + 1);
+      ks_[i] = k - 1;
+      ks_[i + 1] = rest + 1;
     }
+    std::fill(monomial_.begin(), monomial_.end(), 0);
+    coeff_ = 1.0;
+    for (size_t j = 0; j < m; ++j) {
+      auto mj = rows_.monomial(j);
+      for (size_t w = 0; w < words_; ++w) {
+        monomial_[w] += ks_[j] * mj[w];
+      }
+      coeff_ *= binomials_[j] * powers_[j][ks_[j]];
+    }
+  } while (isNearlyEqual(coeff_, 0.0));
+  return true;
+}
+
+bool Symbol::Impl_::PolynomialStream::next() {
+  switch(mode_) {
+  case Mode::PRODUCT:
+    return nextProduct();
+  case Mode::MULTINOMIAL:
+    return nextMultinomial();
+  default:
+    return nextNode();
   }
-  if (isNearlyEqual(constOperand->value(), 0,0)) {
-    return constructZero();
+}
+
+const uint64_t* Symbol::Impl_::PolynomialStream::monomial() const {
+  return monomial_.data();
+}
+
+double Symbol::Impl_::PolynomialStream::coefficient() const {
+  return coeff_;
+}
+
+uint32_t Symbol::Impl_::PolynomialStream::exponent(size_t variable) const {
+  return Polynomial::exponentOf(monomial_.data(), variable);
+}
+
+void Symbol::Impl_::TermRun::Close::operator()(FILE* file) const {
+  std::fclose(file);
+}
+
+Symbol::Impl_::TermRun::TermRun(size_t words)
+  : file_(std::tmpfile())
+  , words_(words)
+  , size_(0)
+{
+  if (!file_) {
+    LOG_AND_THROW("Failed to create a temporary file.");
   }
-  // Reconstruct Expression.
-  Operands operands;
-  // Push back the constant term
-  if (!isNearlyEqual(constOperand->value(), 1.0)) {
-    operands.push_back(constOperand);
+}
+
+size_t Symbol::Impl_::TermRun::size() const {
+  return size_;
+}
+
+void Symbol::Impl_::TermRun::push(const uint64_t* monomial, double coeff) {
+  if (words_ != std::fwrite(monomial, sizeof(uint64_t), words_, file_.get()) ||
+      1 != std::fwrite(&coeff, sizeof(double), 1, file_.get())) {
+    LOG_AND_THROW("Failed to write to a temporary file.");
   }
-  // Push back the other term
-  for (auto& entry : nonConstOperands) {
-    if (entry.second->isZero()) {
-      // exponent == 0: X ^ 0 -> 1
-      continue;
-    } else if (entry.second->isOne()) {
-      // exponent == 1: X ^ 1 -> X
-      operands.push_back(entry.first);
-    } else {
-      operands.push_back(constructPOWER({entry.first, entry.second}));
+  ++size_;
+}
+
+void Symbol::Impl_::TermRun::push(const Polynomial& p) {
+  for (size_t i = 0; i < p.size(); ++i) {
+    push(p.monomial(i), p.coeffs_[i]);
+  }
+}
+
+void Symbol::Impl_::TermRun::rewind() {
+  if (0 != std::fflush(file_.get())) {
+    LOG_AND_THROW("Failed to write to a temporary file.");
+  }
+  std::rewind(file_.get());
+}
+
+/// Returns false at the end of the run. A failed or partial read throws
+/// rather than ending the run early.
+bool Symbol::Impl_::TermRun::read(uint64_t* monomial, double& coeff) {
+  auto n = std::fread(monomial, sizeof(uint64_t), words_, file_.get());
+  if (0 == n && std::feof(file_.get())) {
+    return false;
+  }
+  if (words_ != n || 1 != std::fread(&coeff, sizeof(double), 1, file_.get())) {
+    LOG_AND_THROW("Failed to read from a temporary file.");
+  }
+  return true;
+}
+
+bool Symbol::Impl_::TermRun::read(Polynomial& p, size_t n) {
+  p = Polynomial(0);
+  p.words_ = words_;
+  std::vector<uint64_t> m(words_);
+  double coeff;
+  while (p.size() < n && read(m.data(), coeff)) {
+    p.push(m.data(), coeff);
+    uint32_t degree = 0;
+    for (size_t v = 0; v < words_ * Polynomial::VARIABLES_PER_WORD; ++v) {
+      degree += Polynomial::exponentOf(m.data(), v);
     }
+    p.degree_ = std::max(p.degree_, degree);
   }
-  return constructMULTIPLY(operands);
+  return p.size();
 }
 
-/// Merger POWER expression
-/// ex)
-///   C1 ^ C2 -> C3
-///   1 ^ X -> 1
-///   X ^ 0 -> 1
-///   X ^ 1 -> X
-Symbol::pExp Symbol::Impl_::mergePOWER(pExp e) {
-  if (Operator::POWER != e->operator_) {
-    LOG_AND_THROW("mergePOWER called on non-POWER Expression.");
+/// k-way merge by a heap of the runs by their current term.
+/// Runs beyond MERGE_FANIN are merged in groups first,
+/// which bounds the number of runs read at once.
+Symbol::Impl_::TermRun Symbol::Impl_::TermRun::merge(std::vector<TermRun>& runs, size_t words) {
+  while (runs.size() > MERGE_FANIN) {
+    std::vector<TermRun> merged;
+    for (size_t i = 0; i < runs.size(); i += MERGE_FANIN) {
+      std::vector<TermRun> group;
+      for (size_t j = i; j < std::min(runs.size(), i + MERGE_FANIN); ++j) {
+        group.push_back(std::move(runs[j]));
+      }
+      merged.push_back(merge(group, words));
+    }
+    runs.swap(merged);
   }
-  auto base = e->operands_[0];
-  auto expo = e->operands_[1];
-  if (base->isConst() && expo->isConst()) {
-    return constructCONST(std::pow(base->value(), expo->value()));
+  TermRun ret(words);
+  Polynomial order(0);
+  order.words_ = words;
+  std::vector<uint64_t> monomials(runs.size() * words);
+  std::vector<double> coeffs(runs.size());
+  auto less = [&](size_t run1, size_t run2) {
+    return order.compare(monomials.data() + run1 * words, monomials.data() + run2 * words) > 0;
+  };
+  std::vector<size_t> heap;
+  for (size_t i = 0; i < runs.size(); ++i) {
+    runs[i].rewind();
+    if (runs[i].read(monomials.data() + i * words, coeffs[i])) {
+      heap.push_back(i);
+    }
   }
-  if (base->isOne() || expo->isZero()) {
-    return constructOne();
+  std::make_heap(heap.begin(), heap.end(), less);
+  std::vector<uint64_t> m(words);
+  while (!heap.empty()) {
+    auto top = heap.front();
+    std::copy(monomials.data() + top * words, monomials.data() + (top + 1) * words, m.begin());
+    double coeff = 0;
+    // Pop every run whose current term has the same monomial.
+    while (!heap.empty() && 0 == order.compare(monomials.data() + heap.front() * words, m.data())) {
+      std::pop_heap(heap.begin(), heap.end(), less);
+      auto run = heap.back();
+      heap.pop_back();
+      coeff += coeffs[run];
+      if (runs[run].read(monomials.data() + run * words, coeffs[run])) {
+        heap.push_back(run);
+        std::push_heap(heap.begin(), heap.end(), less);
+      }
+    }
+    if (!isNearlyEqual(coeff, 0.0)) {
+      ret.push(m.data(), coeff);
+    }
   }
-  if (expo->isOne()) {
-    return base;
+  runs.clear();
+  ret.rewind();
+  return ret;
+}
+
+Symbol::Impl_::PolynomialRing::PolynomialRing(const pExp& e)
+  : atoms_()
+  , indices_()
+{
+  collect(e);
+  sortAtoms();
+}
+
+Symbol::Impl_::PolynomialRing::PolynomialRing(const Operands& es)
+  : atoms_()
+  , indices_()
+{
+  for (auto& e : es) {
+    collect(e);
   }
-  return e;
+  sortAtoms();
 }
 
-/// log(1) -> 0
-Symbol::pExp Symbol::Impl_::mergeLOG(pExp e) {
-  if (Operator::LOG != e->operator_) {
-    LOG_AND_THROW("mergeLOG called on non-LOG Expression.");
+/// Atoms in the structural order, so that the order of monomials
+/// does not depend on where the atoms were found.
+void Symbol::Impl_::PolynomialRing::sortAtoms() {
+  std::sort(atoms_.begin(), atoms_.end(), compareOperands());
+  for (size_t i = 0; i < atoms_.size(); ++i) {
+    indices_[atoms_[i]] = i;
   }
-  if (e->operands_[0]->isOne()) {
-    return constructZero();
-  } else {
-    return e;
+}
+
+/// Power with a positive integer exponent, which is expanded.
+bool Symbol::Impl_::PolynomialRing::isPower(const pExp& e) {
+  if (Operator::POWER != e->operator_ || !e->operands_[1]->isConst()) {
+    return false;
   }
+  auto n = e->operands_[1]->value_;
+  return n > 0 && isInteger(n) && n <= Polynomial::MAX_DEGREE;
 }
 
-/// Decompose an Expression into coefficient and non-coefficient part
-/// such that pExp == coeff * non-coeff
-/// This function is made for simplifying the mergeADD.
-/// This decomposition is not necessarily generally apprecable.
-Symbol::Operands Symbol::Impl_::decompose2(Operand o) {
-  switch (o->operator_) {
+void Symbol::Impl_::PolynomialRing::collect(const pExp& e) {
+  switch(e->operator_) {
   case Operator::CONST:
-    return {o, constructOne()};
+    return;
+  case Operator::NEGATE:
   case Operator::ADD:
-  case Operator::POWER:
-  case Operator::VARIABLE:
-  case Operator::LOG:
-    return {constructOne(), o};
-  case Operator::NEGATE: {
-    Operands ret = decompose2(o->operands_[0]);
-    *ret[0]->pVal_ *= -1;
-    return ret;
+  case Operator::MULTIPLY:
+    for (auto& operand : e->operands_) {
+      collect(operand);
+    }
+    return;
+  default:
+    if (isPower(e)) {
+      collect(e->operands_[0]);
+    } else if (!indices_.count(e)) {
+      indices_[e] = atoms_.size();
+      atoms_.push_back(e);
+    }
+  }
+}
+
+size_t Symbol::Impl_::PolynomialRing::size() const {
+  return atoms_.size();
+}
+
+bool Symbol::Impl_::PolynomialRing::toPolynomial(const pExp& e, Polynomial& p) const {
+  auto n = atoms_.size();
+  switch(e->operator_) {
+  case Operator::CONST:
+    p = Polynomial::constant(n, e->value_);
+    return true;
+  case Operator::NEGATE:
+    if (!toPolynomial(e->operands_[0], p)) {
+      return false;
+    }
+    p = p * -1.0;
+    return true;
+  case Operator::ADD: {
+    p = Polynomial::constant(n, e->value_);
+    Polynomial operand(n);
+    for (auto& operand_ : e->operands_) {
+      Polynomial::Deadline::check();
+      if (!toPolynomial(operand_, operand)) {
+        return false;
+      }
+      p = p + operand;
+    }
+    return true;
   }
   case Operator::MULTIPLY: {
-    double constant = 1;
-    Operands operands;
-    for (auto& operand : o->operands_) {
-      if (operand->isConst()) {
-        constant *= operand->value();
-      } else {
-        operands.push_back(operand);
+    p = Polynomial::constant(n, e->value_);
+    Polynomial operand(n);
+    for (auto& operand_ : e->operands_) {
+      if (!toPolynomial(operand_, operand) ||
+          p.degree() + operand.degree() > Polynomial::MAX_DEGREE) {
+        return false;
       }
+      p = p * operand;
     }
-    return {constructCONST(constant), constructMULTIPLY(operands)};
+    return true;
+  }
+  default:
+    break;
   }
+  if (isPower(e)) {
+    uint32_t expo = std::round(e->operands_[1]->value_);
+    if (!toPolynomial(e->operands_[0], p) ||
+        uint64_t(p.degree()) * expo > Polynomial::MAX_DEGREE) {
+      return false;
+    }
+    p = p.pow(expo);
+    return true;
   }
-};
+  p = Polynomial::variable(n, indices_.at(e));
+  return true;
+}
 
-/// Decompose an Expression into coefficient, base and exponent
-/// so that pExp == coeff * (base ^ expo)
-/// This function is made for simplifying the mergeMULTIPLY.
-/// This decomposition is not necessarily generally apprecable.
-Symbol::Operands Symbol::Impl_::decompose3(Operand o) {
-  switch (o->operator_) {
-  case Operator::CONST:
-    return {o, constructZero(), constructZero()};
-  case Operator::VARIABLE:
-  case Operator::LOG:
-    return {constructOne(), o, constructOne()};
-  case Operator::NEGATE: {
-    Operands ret = decompose3(o->operands_[0]);
-    *ret[0]->pVal_ *= -1;
-    return ret;
+/// Terms are built in the form mergeADD makes, coeff * X ^ n * Y ^ m.
+Symbol::pExp Symbol::Impl_::PolynomialRing::toExp(const Polynomial& p) const {
+  Operands terms;
+  double constant = 0;
+  std::vector<uint32_t> exponents(atoms_.size());
+  for (size_t i = 0; i < p.size(); ++i) {
+    bool isConstant = true;
+    for (size_t v = 0; v < atoms_.size(); ++v) {
+      exponents[v] = p.exponent(i, v);
+      isConstant = isConstant && 0 == exponents[v];
+    }
+    if (isConstant) {
+      constant += p.coefficient(i);
+    } else {
+      terms.push_back(toTerm(exponents, p.coefficient(i)));
+    }
   }
-  case Operator::ADD:
-    return {constructOne(), o, constructOne()};
-  case Operator::MULTIPLY: {
-    double constant = 1;
-    Operands operands;
-    for (auto& operand : o->operands_) {
-      if (operand->isConst()) {
-        constant *= *operand->pVal_;
-      } else {
-        operands.push_back(operand);
-      }
+  return constructADD(terms, constant);
+}
+
+Symbol::pExp Symbol::Impl_::PolynomialRing::toTerm(const std::vector<uint32_t>& exponents,
+                                                   double coeff) const {
+  Operands factors;
+  for (size_t v = 0; v < atoms_.size(); ++v) {
+    auto n = exponents[v];
+    if (1 == n) {
+      factors.push_back(atoms_[v]);
+    } else if (n) {
+      factors.push_back(constructPOWER({atoms_[v], constructCONST(n)}));
     }
-    return {constructCONST(constant), constructMULTIPLY(operands), constructOne()};
   }
-  case Operator::POWER:
-    return {constructOne(), o->operands_[0], o->operands_[1]};
+  if (factors.empty()) {
+    return constructCONST(coeff);
   }
-};
+  return scaleTerm(constructMULTIPLY(factors), coeff);
+}
+
+/// Simplify the operands which are not simplified yet.
+Symbol::pExp Symbol::Impl_::simplifyOperands(pExp e) {
+  // Expressions are shared, so rebuild the node instead of
+  // overwriting its operands when any of them simplifies.
+  Operands operands;
+  bool changed = false;
+  for (auto& operand_ : e->operands_) {
+    operands.push_back(simplify(operand_));
+    changed = changed || operands.back() != operand_;
+  }
+  if (changed) {
+    return constructOperation(e->operator_, operands, e->value_);
+  }
+  return e;
+}
 
 Symbol::pExp Symbol::Impl_::simplify(pExp e) {
-  std::transform(e->operands_.begin(), e->operands_.end(),
-		 e->operands_.begin(), Impl_::simplify);
-  std::string before;
+  // Results of simplify are canonical, so only new nodes are worked on.
+  if (e->isSimplified()) {
+    return e;
+  }
+  auto refused = refusals();
+  // Passes return the given node when they change nothing,
+  // so the fixpoint is usually detected by pointer comparison.
+  // Operands created by the passes are simplified on the next iteration.
+  pExp before;
   do {
-    before = e->toStr(false);
+    before = e;
+    e = simplifyOperands(e);
     e = flatten(e);
     e = expand(e);
   }
-  while(before != e->toStr(false));
+  while(!isSame(before, e));
   do {
-    before = e->toStr(false);
+    before = e;
+    e = simplifyOperands(e);
     e = merge(e);
   }
-  while(before != e->toStr(false));
+  while(!isSame(before, e));
   e = sort(e);
+  if (refused == refusals()) {
+    e->simplified_.store(true, std::memory_order_relaxed);
+  }
   return e;
 }
 
@@ -1279,7 +4633,7 @@ Symbol::pExp Symbol::Impl_::differentiate(pExp y, Operand x) {
           operands.push_back(y->operands_[j]);
         }
       }
-      operandsSet.push_back(constructMULTIPLY(operands));
+      operandsSet.push_back(constructMULTIPLY(operands, y->value_));
     }
     return constructADD(operandsSet);
   }
@@ -1298,36 +4652,43 @@ Symbol::pExp Symbol::Impl_::differentiate(pExp y, Operand x) {
   }
 }
 
+std::string Symbol::Impl_::constToStr(const double val, bool bracket) {
+  if (isNearlyEqual(val, 0.0)) {
+    return "0";
+  } else if (isNearlyEqual(val, 1.0)) {
+    return "1";
+  }
+  std::stringstream ss;
+  if (isInteger(val)) {
+    ss << std::fixed << std::setprecision(0) << std::abs(val);
+  } else {
+    ss << std::fixed << std::setprecision(3) << std::abs(val);
+  }
+  if (val > 0.0) {
+    // We don't need to bracket the positive constant, so return here.
+    return ss.str();
+  }
+  std::string ret = " - " + ss.str();
+  if (bracket) {
+    ret = "(" + ret + ")";
+  }
+  return ret;
+}
+
 std::string Symbol::Impl_::Exp::toStr(bool bracket) const {
   std::string ret;
   switch(operator_) {
   case Operator::CONST:
-    if (isZero()) {
-      return "0";
-    } else if (isOne()) {
-      return "1";
-    } else {
-      std::stringstream ss;
-      auto val = value();
-      if (isInteger(val)) {
-        ss << std::fixed << std::setprecision(0) << std::abs(val);
-      } else {
-        ss << std::fixed << std::setprecision(3) << std::abs(val);
-      }
-      if (isNegative()) {
-        ret = " - " + ss.str();
-      } else {
-        // We don't need to bracket the positive constant, so return here.
-        return ss.str();
-      }
-    }
-    break;
+    return constToStr(value_, bracket);
   case Operator::VARIABLE:
-    return name_;
+    return name();
   case Operator::NEGATE:
     ret = " - " + operands_[0]->toStr(true);
     break;
-  case Operator::ADD:
+  case Operator::ADD: {
+    if (hasCoefficient()) {
+      ret = constToStr(value_, false);
+    }
     for (auto& operand : operands_) {
       std::string append;
       if (operand->isNegative() ||
@@ -1342,7 +4703,11 @@ std::string Symbol::Impl_::Exp::toStr(bool bracket) const {
       }
     }
     break;
-  case Operator::MULTIPLY:
+  }
+  case Operator::MULTIPLY: {
+    if (hasCoefficient()) {
+      ret = constToStr(value_, true);
+    }
     for (auto& operand : operands_) {
       auto append = operand->toStr(true);
       if (0 != ret.size()) {
@@ -1351,6 +4716,7 @@ std::string Symbol::Impl_::Exp::toStr(bool bracket) const {
       ret += append;
     }
     break;
+  }
   case Operator::POWER: {
     auto base = operands_[0]->toStr(true);
     auto expo = operands_[1]->toStr(true);
@@ -1372,11 +4738,12 @@ std::string Symbol::Impl_::Exp::toStr(bool bracket) const {
 void Symbol::Impl_::Exp::assign(double val) {
   switch(operator_) {
   case Operator::VARIABLE:
-    if (!pVal_)
-      pVal_ = std::make_shared<double>(val);
-  case Operator::CONST:
-    *pVal_ = val;
+    if (!pBinding_)
+      pBinding_ = std::allocate_shared<double>(ArenaAllocator<double>(), val);
+    *pBinding_ = val;
     break;
+  case Operator::CONST:
+    LOG_AND_THROW("Cannot assign value to CONST Expression.");
   default:
     LOG_AND_THROW("Cannot assign value to compound expressions.");
   }
@@ -1390,14 +4757,14 @@ double Symbol::Impl_::Exp::evaluate() const {
   case Operator::NEGATE:
     return -operands_[0]->evaluate();
   case Operator::ADD: {
-    double ret = 0;
+    double ret = value_;
     for (auto& operand_ : operands_) {
       ret += operand_->evaluate();
     }
     return ret;
   }
   case Operator::MULTIPLY: {
-    double ret = 1;
+    double ret = value_;
     for (auto& operand_ : operands_) {
       ret *= operand_->evaluate();
     }
@@ -1454,6 +4821,9 @@ Symbol::Expression::Expression(pExp exp)
 {}
 
 bool Symbol::operator == (const Expression& e1, const Expression& e2) {
+  if (Impl_::isSame(e1.pExp_, e2.pExp_)) {
+    return true;
+  }
   return (e1.pExp_ - e2.pExp_)->isZero();
 }
 
@@ -1492,8 +4862,40 @@ Symbol::Expression Symbol::operator - (const Expression& e) {
   return - e.pExp_;
 }
 
-Symbol::Expression Symbol::operator + (const Expression& e1, const Expression& e2) {
-  return e1.pExp_ + e2.pExp_;
+Symbol::Expression Symbol::operator + (const Expression& e1, const Expression& e2) {
+  return e1.pExp_ + e2.pExp_;
+}
+
+Symbol::Expression Symbol::operator + (Expression&& e1, const Expression& e2) {
+  Expression ret(std::move(e1));
+  ret += e2;
+  return ret;
+}
+
+Symbol::Expression Symbol::operator - (Expression&& e1, const Expression& e2) {
+  Expression ret(std::move(e1));
+  ret -= e2;
+  return ret;
+}
+
+Symbol::Expression Symbol::operator * (Expression&& e1, const Expression& e2) {
+  Expression ret(std::move(e1));
+  ret *= e2;
+  return ret;
+}
+
+// Temporaries with a constant take the in-place overloads, which would
+// otherwise be ambiguous with the overloads for constants.
+Symbol::Expression Symbol::operator + (Expression&& e, const double c) {
+  return std::move(e) + Expression(c);
+}
+
+Symbol::Expression Symbol::operator - (Expression&& e, const double c) {
+  return std::move(e) - Expression(c);
+}
+
+Symbol::Expression Symbol::operator * (Expression&& e, const double c) {
+  return std::move(e) * Expression(c);
 }
 
 Symbol::Expression Symbol::operator + (const Expression& e, const double c) {
@@ -1560,12 +4962,141 @@ Symbol::Expression Symbol::log (const double c) {
   return log(Expression(c));
 }
 
+Symbol::Context::Context(size_t chunkSize)
+  : arena_(new Impl_::Arena(chunkSize))
+  , previous_(Impl_::Arena::current())
+{
+  Impl_::Arena::current() = arena_.get();
+}
+
+Symbol::Context::~Context() {
+  Impl_::Arena::current() = previous_;
+  if (arena_->live()) {
+    // Expressions still refer to the arena, so leave it to them.
+    LOG(WARNING) << "Context destroyed while its Expressions are alive.";
+    arena_.release();
+  }
+}
+
+size_t Symbol::Context::live() const {
+  return arena_->live();
+}
+
+void Symbol::Context::reset() {
+  arena_->reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Symbol::Budget::Budget(size_t maxNodes, size_t maxTerms, std::chrono::milliseconds maxTime,
+                       Mode mode)
+  : maxNodes_(maxNodes)
+  , maxTerms_(maxTerms)
+  , deadline_(std::chrono::steady_clock::time_point::max())
+  , mode_(mode)
+  , nodes_(0)
+  , exceeded_(false)
+  , previous_(current())
+{
+  auto now = std::chrono::steady_clock::now();
+  if (maxTime < std::chrono::duration_cast<std::chrono::milliseconds>(deadline_ - now)) {
+    deadline_ = now + maxTime;
+  }
+  current() = this;
+}
+
+Symbol::Budget::~Budget() {
+  current() = previous_;
+}
+
+Symbol::Budget*& Symbol::Budget::current() {
+  static thread_local Budget* budget = nullptr;
+  return budget;
+}
+
+bool Symbol::Budget::expired() const {
+  return std::chrono::steady_clock::now() > deadline_;
+}
+
+void Symbol::Budget::exceed(const char* message) {
+  exceeded_ = true;
+  if (Mode::ABORT == mode_) {
+    LOG_AND_THROW(message);
+  }
+}
+
+size_t Symbol::Budget::nodes() const {
+  return nodes_;
+}
+
+bool Symbol::Budget::exceeded() const {
+  return exceeded_;
+}
+
+double Symbol::Budget::predict(const std::vector<Expression>& factors) {
+  double terms = 1;
+  for (auto& factor : factors) {
+    terms *= Impl_::predictTerms(factor.pExp_);
+  }
+  return terms;
+}
+
+double Symbol::Budget::predict(const Expression& base, uint32_t n) {
+  return Impl_::predictTerms(Impl_::constructPOWER({base.pExp_, Impl_::constructCONST(n)}));
+}
+
 Symbol::Expression Symbol::Expression::differentiate(const Expression& dx) {
   return Impl_::simplify(Impl_::differentiate(pExp_, dx.pExp_));
 }
 
+Symbol::Expression& Symbol::Expression::operator += (const Expression& e) {
+  auto term = Impl_::simplify(e.pExp_);
+  if (!Impl_::appendTerms(pExp_, term)) {
+    pExp_ = pExp_ + term;
+    return *this;
+  }
+  auto& operands = pExp_->operands_;
+  if (operands.size() + pExp_->hasCoefficient() < 2) {
+    // Terms cancelled out: X + Y - Y -> X
+    pExp_ = Impl_::constructADD(operands, pExp_->value_);
+  }
+  return *this;
+}
+
+Symbol::Expression& Symbol::Expression::operator -= (const Expression& e) {
+  return *this += -e;
+}
+
+Symbol::Expression& Symbol::Expression::operator *= (const Expression& e) {
+  auto factor = Impl_::simplify(e.pExp_);
+  Operands rest;
+  if (!Impl_::appendFactors(pExp_, factor, rest)) {
+    pExp_ = pExp_ * factor;
+    return *this;
+  }
+  auto& operands = pExp_->operands_;
+  if (isNearlyEqual(pExp_->value_, 0.0)) {
+    pExp_ = Impl_::constructZero();
+  } else if (operands.size() + pExp_->hasCoefficient() < 2) {
+    // Factors cancelled out: X * Y / Y -> X
+    pExp_ = Impl_::constructMULTIPLY(operands, pExp_->value_);
+  }
+  if (!rest.empty()) {
+    pExp_ = pExp_ * Impl_::constructMULTIPLY(rest);
+  }
+  return *this;
+}
+
+Symbol::Expression& Symbol::Expression::operator /= (const Expression& e) {
+  return *this *= Expression(Impl_::constructInverse(e.pExp_));
+}
+
 Symbol::Expression& Symbol::Expression::assign(double value) {
-  pExp_->assign(value);
+  // CONST nodes may be shared, so rebind to a new constant instead.
+  if (pExp_->isConst()) {
+    pExp_ = Impl_::constructCONST(value);
+  } else {
+    pExp_->assign(value);
+  }
   return *this;
 }
 
@@ -1576,3 +5107,639 @@ double Symbol::Expression::evaluate() const {
 std::ostream& Symbol::operator <<(std::ostream& o, const Expression &e) {
   return o << e.pExp_->toStr(false);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+Symbol::FlatExpression::FlatExpression()
+  : nodes_()
+  , children_()
+{}
+
+Symbol::FlatExpression::FlatExpression(const Expression& e)
+  : nodes_()
+  , children_()
+{
+  using Impl_::Exp;
+  // Iterative post-order traversal, so that deep Expressions
+  // do not exhaust the stack. Shared nodes are visited once.
+  std::unordered_map<const Exp*, uint32_t> indices;
+  std::vector<std::pair<const Exp*, size_t>> stack {{e.pExp_.get(), 0}};
+  while (!stack.empty()) {
+    auto& top = stack.back();
+    auto exp = top.first;
+    if (top.second < exp->operands_.size()) {
+      auto operand = exp->operands_[top.second++].get();
+      if (!indices.count(operand)) {
+        stack.push_back({operand, 0});
+      }
+      continue;
+    }
+    stack.pop_back();
+    if (indices.count(exp)) {
+      continue;
+    }
+    std::vector<uint32_t> operands;
+    if (exp->hasCoefficient()) {
+      operands.push_back(pushConst(exp->value_));
+    }
+    for (auto& operand : exp->operands_) {
+      operands.push_back(indices[operand.get()]);
+    }
+    auto index = push(exp->operator_, operands);
+    nodes_[index].symbol_ = exp->symbol_;
+    nodes_[index].value_ = exp->value();
+    indices[exp] = index;
+  }
+}
+
+uint32_t Symbol::FlatExpression::push
+(Impl_::Operator oprtr, std::initializer_list<uint32_t> operands) {
+  return push(oprtr, std::vector<uint32_t>(operands));
+}
+
+uint32_t Symbol::FlatExpression::push
+(Impl_::Operator oprtr, const std::vector<uint32_t>& operands) {
+  if (nodes_.size() >= UINT32_MAX ||
+      children_.size() + operands.size() >= UINT32_MAX) {
+    LOG_AND_THROW("FlatExpression cannot hold more than 2^32 nodes.");
+  }
+  Node node {oprtr, 0, static_cast<uint32_t>(children_.size()),
+      static_cast<uint32_t>(operands.size()), NAN};
+  children_.insert(children_.end(), operands.begin(), operands.end());
+  nodes_.push_back(node);
+  return nodes_.size() - 1;
+}
+
+uint32_t Symbol::FlatExpression::pushConst(double value) {
+  auto index = push(Impl_::Operator::CONST, {});
+  nodes_[index].value_ = value;
+  return index;
+}
+
+/// Copy the nodes reachable from root, keeping their order.
+Symbol::FlatExpression Symbol::FlatExpression::prune(uint32_t root) const {
+  std::vector<bool> reachable(nodes_.size(), false);
+  reachable[root] = true;
+  for (size_t i = root + 1; i-- > 0;) {
+    if (!reachable[i]) {
+      continue;
+    }
+    auto& node = nodes_[i];
+    for (uint32_t c = 0; c < node.count_; ++c) {
+      reachable[children_[node.first_ + c]] = true;
+    }
+  }
+  FlatExpression ret;
+  std::vector<uint32_t> indices(nodes_.size());
+  for (size_t i = 0; i <= root; ++i) {
+    if (!reachable[i]) {
+      continue;
+    }
+    auto& node = nodes_[i];
+    std::vector<uint32_t> operands;
+    for (uint32_t c = 0; c < node.count_; ++c) {
+      operands.push_back(indices[children_[node.first_ + c]]);
+    }
+    indices[i] = ret.push(node.operator_, operands);
+    ret.nodes_[indices[i]].symbol_ = node.symbol_;
+    ret.nodes_[indices[i]].value_ = node.value_;
+  }
+  return ret;
+}
+
+Symbol::Expression Symbol::FlatExpression::toExpression() const {
+  using namespace Impl_;
+  if (nodes_.empty()) {
+    LOG_AND_THROW("Cannot convert empty FlatExpression.");
+  }
+  std::vector<pExp> exps(nodes_.size());
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    auto& node = nodes_[i];
+    Operands operands;
+    for (uint32_t c = 0; c < node.count_; ++c) {
+      operands.push_back(exps[children_[node.first_ + c]]);
+    }
+    switch(node.operator_) {
+    case Operator::CONST:
+      exps[i] = constructCONST(node.value_);
+      break;
+    case Operator::VARIABLE: {
+      auto& name = SymbolTable::instance().name(node.symbol_);
+      exps[i] = std::isnan(node.value_) ?
+        constructVARIABLE(name) : constructVARIABLE(name, node.value_);
+      break;
+    }
+    default:
+      exps[i] = constructOperation(node.operator_, operands);
+    }
+  }
+  return Expression(simplify(exps.back()));
+}
+
+size_t Symbol::FlatExpression::size() const {
+  return nodes_.size();
+}
+
+const std::vector<Symbol::FlatExpression::Node>& Symbol::FlatExpression::nodes() const {
+  return nodes_;
+}
+
+const std::vector<uint32_t>& Symbol::FlatExpression::children() const {
+  return children_;
+}
+
+Symbol::FlatExpression& Symbol::FlatExpression::assign(const std::string& name, double value) {
+  auto symbol = Impl_::SymbolTable::instance().intern(name);
+  for (auto& node : nodes_) {
+    if (Impl_::Operator::VARIABLE == node.operator_ && symbol == node.symbol_) {
+      node.value_ = value;
+    }
+  }
+  return *this;
+}
+
+double Symbol::FlatExpression::evaluate() const {
+  using Impl_::Operator;
+  if (nodes_.empty()) {
+    return NAN;
+  }
+  std::vector<double> values(nodes_.size());
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    auto& node = nodes_[i];
+    auto operand = children_.data() + node.first_;
+    switch(node.operator_) {
+    case Operator::CONST:
+    case Operator::VARIABLE:
+      values[i] = node.value_;
+      break;
+    case Operator::NEGATE:
+      values[i] = -values[operand[0]];
+      break;
+    case Operator::ADD:
+      values[i] = 0;
+      for (uint32_t c = 0; c < node.count_; ++c) {
+        values[i] += values[operand[c]];
+      }
+      break;
+    case Operator::MULTIPLY:
+      values[i] = 1;
+      for (uint32_t c = 0; c < node.count_; ++c) {
+        values[i] *= values[operand[c]];
+      }
+      break;
+    case Operator::POWER:
+      values[i] = std::pow(values[operand[0]], values[operand[1]]);
+      break;
+    case Operator::LOG:
+      values[i] = std::log(values[operand[0]]);
+      break;
+    }
+  }
+  return values.back();
+}
+
+/// Differentiate in one pass over the nodes, appending the derivative of
+/// each node after the original ones. The result is not simplified.
+Symbol::FlatExpression Symbol::FlatExpression::differentiate(const Expression& dx) const {
+  using Impl_::Operator;
+  if (Operator::VARIABLE != dx.pExp_->operator_) {
+    LOG_AND_THROW("FlatExpression can only be differentiated with VARIABLE.");
+  }
+  if (nodes_.empty()) {
+    return FlatExpression();
+  }
+  auto symbol = dx.pExp_->symbol_;
+  FlatExpression ret = *this;
+  const uint32_t ZERO = ret.pushConst(0);
+  const uint32_t ONE = ret.pushConst(1);
+  const uint32_t MINUS_ONE = ret.pushConst(-1);
+  auto multiply = [&ret, ZERO, ONE](std::vector<uint32_t> factors) {
+    std::vector<uint32_t> operands;
+    for (auto f : factors) {
+      if (ZERO == f) {
+        return ZERO;
+      }
+      if (ONE != f) {
+        operands.push_back(f);
+      }
+    }
+    if (operands.empty()) {
+      return ONE;
+    }
+    return 1 == operands.size() ? operands[0] : ret.push(Operator::MULTIPLY, operands);
+  };
+  auto add = [&ret, ZERO](std::vector<uint32_t> terms) {
+    std::vector<uint32_t> operands;
+    for (auto t : terms) {
+      if (ZERO != t) {
+        operands.push_back(t);
+      }
+    }
+    if (operands.empty()) {
+      return ZERO;
+    }
+    return 1 == operands.size() ? operands[0] : ret.push(Operator::ADD, operands);
+  };
+  std::vector<uint32_t> derivatives(nodes_.size(), ZERO);
+  for (uint32_t i = 0; i < nodes_.size(); ++i) {
+    auto node = nodes_[i];
+    std::vector<uint32_t> operands(children_.data() + node.first_,
+                                   children_.data() + node.first_ + node.count_);
+    switch(node.operator_) {
+    case Operator::CONST:
+      break;
+    case Operator::VARIABLE:
+      derivatives[i] = symbol == node.symbol_ ? ONE : ZERO;
+      break;
+    case Operator::NEGATE: {
+      auto d = derivatives[operands[0]];
+      derivatives[i] = ZERO == d ? ZERO : ret.push(Operator::NEGATE, {d});
+      break;
+    }
+    case Operator::ADD: {
+      std::vector<uint32_t> terms;
+      for (auto o : operands) {
+        terms.push_back(derivatives[o]);
+      }
+      derivatives[i] = add(terms);
+      break;
+    }
+    case Operator::MULTIPLY: {
+      // (f * g)' = f' * g + f * g'
+      std::vector<uint32_t> terms;
+      for (size_t k = 0; k < operands.size(); ++k) {
+        std::vector<uint32_t> factors = operands;
+        factors[k] = derivatives[operands[k]];
+        terms.push_back(multiply(factors));
+      }
+      derivatives[i] = add(terms);
+      break;
+    }
+    case Operator::POWER: {
+      // (f ^ g)' = f ^ g * (g' * log(f) + g * f' / f)
+      auto f = operands[0], g = operands[1];
+      auto fp = derivatives[f], gp = derivatives[g];
+      if (ZERO == gp) {
+        // (f ^ C)' = C * f ^ (C - 1) * f'
+        auto expo = ret.push(Operator::ADD, {g, MINUS_ONE});
+        auto power = ret.push(Operator::POWER, {f, expo});
+        derivatives[i] = multiply({g, power, fp});
+        break;
+      }
+      auto logf = ret.push(Operator::LOG, {f});
+      auto invf = ret.push(Operator::POWER, {f, MINUS_ONE});
+      auto inner = add({multiply({gp, logf}), multiply({g, fp, invf})});
+      derivatives[i] = multiply({i, inner});
+      break;
+    }
+    case Operator::LOG: {
+      // log(f)' = f' / f
+      auto f = operands[0];
+      auto invf = ret.push(Operator::POWER, {f, MINUS_ONE});
+      derivatives[i] = multiply({derivatives[f], invf});
+      break;
+    }
+    }
+  }
+  return ret.prune(derivatives[nodes_.size() - 1]);
+}
+
+std::string Symbol::FlatExpression::toStr() const {
+  if (nodes_.empty()) {
+    return "";
+  }
+  return toStr(nodes_.size() - 1, false);
+}
+
+std::string Symbol::FlatExpression::toStr(uint32_t index, bool bracket) const {
+  using Impl_::Operator;
+  auto& node = nodes_[index];
+  auto operand = children_.data() + node.first_;
+  std::string ret;
+  switch(node.operator_) {
+  case Operator::CONST:
+    return Impl_::constToStr(node.value_, bracket);
+  case Operator::VARIABLE:
+    return Impl_::SymbolTable::instance().name(node.symbol_);
+  case Operator::NEGATE:
+    ret = " - " + toStr(operand[0], true);
+    break;
+  case Operator::ADD:
+    for (uint32_t c = 0; c < node.count_; ++c) {
+      auto& child = nodes_[operand[c]];
+      bool negative = Operator::NEGATE == child.operator_ ||
+        (Operator::CONST == child.operator_ &&
+         !isNearlyEqual(child.value_, 0.0) && child.value_ < 0.0);
+      if (negative) {
+        ret += toStr(operand[c], false);
+      } else {
+        if (0 != ret.size())
+          ret += " + ";
+        ret += toStr(operand[c], true);
+      }
+    }
+    break;
+  case Operator::MULTIPLY:
+    for (uint32_t c = 0; c < node.count_; ++c) {
+      if (0 != ret.size()) {
+        ret += " * ";
+      }
+      ret += toStr(operand[c], true);
+    }
+    break;
+  case Operator::POWER:
+    ret = toStr(operand[0], true) + " ^ " + toStr(operand[1], true);
+    break;
+  case Operator::LOG:
+    return "log(" + toStr(operand[0], false) + ")";
+  }
+  if (bracket) {
+    ret = "(" + ret + ")";
+  }
+  return ret;
+}
+
+void Symbol::FlatExpression::write(std::ostream& o) const {
+  auto put = [&o](const void* p, size_t n) {
+    o.write(static_cast<const char*>(p), n);
+  };
+  // Symbol IDs are local to the process, so write the names used.
+  std::unordered_map<uint32_t, uint32_t> symbols;
+  std::vector<uint32_t> order;
+  for (auto& node : nodes_) {
+    if (Impl_::Operator::VARIABLE == node.operator_ && !symbols.count(node.symbol_)) {
+      symbols[node.symbol_] = order.size();
+      order.push_back(node.symbol_);
+    }
+  }
+  uint32_t n = order.size();
+  put("SYMF", 4);
+  put(&n, sizeof(n));
+  for (auto id : order) {
+    auto& name = Impl_::SymbolTable::instance().name(id);
+    uint32_t length = name.size();
+    put(&length, sizeof(length));
+    put(name.data(), length);
+  }
+  n = nodes_.size();
+  put(&n, sizeof(n));
+  for (auto& node : nodes_) {
+    uint8_t oprtr = static_cast<uint8_t>(node.operator_);
+    uint32_t symbol = Impl_::Operator::VARIABLE == node.operator_ ? symbols[node.symbol_] : 0;
+    put(&oprtr, sizeof(oprtr));
+    put(&symbol, sizeof(symbol));
+    put(&node.first_, sizeof(node.first_));
+    put(&node.count_, sizeof(node.count_));
+    put(&node.value_, sizeof(node.value_));
+  }
+  n = children_.size();
+  put(&n, sizeof(n));
+  put(children_.data(), n * sizeof(uint32_t));
+}
+
+/// Every field is validated, so that a corrupt or truncated input throws
+/// here instead of failing later. Sizes read from the input are not
+/// trusted for allocation: elements are read in bounded chunks, so memory
+/// grows only with the data actually present.
+Symbol::FlatExpression Symbol::FlatExpression::read(std::istream& i) {
+  const size_t CHUNK = 4096;
+  auto get = [&i](void* p, size_t n) {
+    if (!i.read(static_cast<char*>(p), n)) {
+      LOG_AND_THROW("Failed to read FlatExpression.");
+    }
+  };
+  char magic[4];
+  get(magic, 4);
+  if (0 != std::memcmp(magic, "SYMF", 4)) {
+    LOG_AND_THROW("Input is not a FlatExpression.");
+  }
+  FlatExpression ret;
+  uint32_t n;
+  get(&n, sizeof(n));
+  std::vector<uint32_t> symbols;
+  for (uint32_t s = 0; s < n; ++s) {
+    uint32_t length;
+    get(&length, sizeof(length));
+    std::string name;
+    while (name.size() < length) {
+      auto offset = name.size();
+      name.resize(offset + std::min<size_t>(CHUNK, length - offset));
+      get(&name[offset], name.size() - offset);
+    }
+    symbols.push_back(Impl_::SymbolTable::instance().intern(name));
+  }
+  get(&n, sizeof(n));
+  for (uint32_t k = 0; k < n; ++k) {
+    Node node;
+    uint8_t oprtr;
+    uint32_t symbol;
+    get(&oprtr, sizeof(oprtr));
+    get(&symbol, sizeof(symbol));
+    get(&node.first_, sizeof(node.first_));
+    get(&node.count_, sizeof(node.count_));
+    get(&node.value_, sizeof(node.value_));
+    if (oprtr > static_cast<uint8_t>(Impl_::Operator::LOG)) {
+      LOG_AND_THROW("FlatExpression has an invalid operator.");
+    }
+    node.operator_ = static_cast<Impl_::Operator>(oprtr);
+    node.symbol_ = 0;
+    bool arity = true;
+    switch(node.operator_) {
+    case Impl_::Operator::CONST:
+      arity = 0 == node.count_;
+      break;
+    case Impl_::Operator::VARIABLE:
+      arity = 0 == node.count_;
+      if (symbol >= symbols.size()) {
+        LOG_AND_THROW("FlatExpression has an invalid symbol.");
+      }
+      node.symbol_ = symbols[symbol];
+      break;
+    case Impl_::Operator::NEGATE:
+    case Impl_::Operator::LOG:
+      arity = 1 == node.count_;
+      break;
+    case Impl_::Operator::POWER:
+      arity = 2 == node.count_;
+      break;
+    case Impl_::Operator::ADD:
+    case Impl_::Operator::MULTIPLY:
+      // The coefficient is stored as an operand, so there are always two.
+      arity = 2 <= node.count_;
+      break;
+    }
+    if (!arity) {
+      LOG_AND_THROW("FlatExpression has an invalid number of operands.");
+    }
+    ret.nodes_.push_back(node);
+  }
+  get(&n, sizeof(n));
+  while (ret.children_.size() < n) {
+    auto offset = ret.children_.size();
+    ret.children_.resize(offset + std::min<size_t>(CHUNK, n - offset));
+    get(&ret.children_[offset], (ret.children_.size() - offset) * sizeof(uint32_t));
+  }
+  // Operands must be earlier nodes, which also rules out cycles.
+  for (size_t k = 0; k < ret.nodes_.size(); ++k) {
+    auto& node = ret.nodes_[k];
+    if (uint64_t(node.first_) + node.count_ > ret.children_.size()) {
+      LOG_AND_THROW("FlatExpression has an invalid operand range.");
+    }
+    for (uint32_t c = node.first_; c < node.first_ + node.count_; ++c) {
+      if (ret.children_[c] >= k) {
+        LOG_AND_THROW("FlatExpression operands are not in topological order.");
+      }
+    }
+  }
+  return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Symbol::TermStream::TermStream(const std::vector<Expression>& factors)
+  : ring_()
+  , stream_()
+{
+  Operands es;
+  for (auto& factor : factors) {
+    es.push_back(factor.pExp_);
+  }
+  ring_.reset(new Impl_::PolynomialRing(es));
+  std::vector<Impl_::Polynomial> polynomials;
+  uint64_t degree = 0;
+  for (auto& e : es) {
+    polynomials.push_back(Impl_::Polynomial(ring_->size()));
+    if (!ring_->toPolynomial(e, polynomials.back())) {
+      LOG_AND_THROW("Degree of the expansion exceeds the maximum.");
+    }
+    degree += polynomials.back().degree();
+  }
+  if (degree > Impl_::Polynomial::MAX_DEGREE) {
+    LOG_AND_THROW("Degree of the expansion exceeds the maximum.");
+  }
+  if (polynomials.empty()) {
+    polynomials.push_back(Impl_::Polynomial::constant(ring_->size(), 1));
+  }
+  stream_.reset(new Impl_::PolynomialStream(polynomials));
+}
+
+Symbol::TermStream::TermStream(const Expression& base, uint32_t n)
+  : ring_(new Impl_::PolynomialRing(base.pExp_))
+  , stream_()
+{
+  Impl_::Polynomial p(ring_->size());
+  if (!ring_->toPolynomial(base.pExp_, p) ||
+      uint64_t(p.degree()) * n > Impl_::Polynomial::MAX_DEGREE) {
+    LOG_AND_THROW("Degree of the expansion exceeds the maximum.");
+  }
+  stream_.reset(new Impl_::PolynomialStream(p, n));
+}
+
+Symbol::TermStream::~TermStream() {}
+
+bool Symbol::TermStream::next(Expression& term) {
+  if (!stream_->next()) {
+    return false;
+  }
+  std::vector<uint32_t> exponents(ring_->size());
+  for (size_t v = 0; v < exponents.size(); ++v) {
+    exponents[v] = stream_->exponent(v);
+  }
+  term = Expression(Impl_::simplify(ring_->toTerm(exponents, stream_->coefficient())));
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Symbol::ExternalExpansion::ExternalExpansion(const std::vector<Expression>& factors,
+                                             size_t maxTerms)
+  : ring_()
+  , run_()
+{
+  Operands es;
+  for (auto& factor : factors) {
+    es.push_back(factor.pExp_);
+  }
+  ring_.reset(new Impl_::PolynomialRing(es));
+  auto n = ring_->size();
+  auto words = Impl_::Polynomial::words(n);
+  std::vector<Impl_::Polynomial> polynomials;
+  uint64_t degree = 0;
+  for (auto& e : es) {
+    polynomials.push_back(Impl_::Polynomial(n));
+    if (!ring_->toPolynomial(e, polynomials.back())) {
+      LOG_AND_THROW("Degree of the expansion exceeds the maximum.");
+    }
+    degree += polynomials.back().degree();
+  }
+  if (degree > Impl_::Polynomial::MAX_DEGREE) {
+    LOG_AND_THROW("Degree of the expansion exceeds the maximum.");
+  }
+
+  run_.reset(new Impl_::TermRun(words));
+  run_->push(Impl_::Polynomial::constant(n, 1));
+  for (auto& factor : polynomials) {
+    // Rows of the partial product are read in chunks
+    // whose products with the factor have about maxTerms terms.
+    auto rows = std::max<size_t>(1, maxTerms / std::max<size_t>(1, factor.size()));
+    std::vector<Impl_::TermRun> runs;
+    Impl_::Polynomial chunk(n);
+    run_->rewind();
+    while (run_->read(chunk, rows)) {
+      // Keep at most MERGE_FANIN runs open.
+      if (runs.size() == Impl_::TermRun::MERGE_FANIN) {
+        auto merged = Impl_::TermRun::merge(runs, words);
+        runs.push_back(std::move(merged));
+      }
+      runs.push_back(Impl_::TermRun(words));
+      runs.back().push(chunk * factor);
+    }
+    run_.reset(new Impl_::TermRun(Impl_::TermRun::merge(runs, words)));
+  }
+  run_->rewind();
+}
+
+Symbol::ExternalExpansion::~ExternalExpansion() {}
+
+size_t Symbol::ExternalExpansion::size() const {
+  return run_->size();
+}
+
+bool Symbol::ExternalExpansion::next(Expression& term) {
+  std::vector<uint64_t> m(Impl_::Polynomial::words(ring_->size()));
+  double coeff;
+  if (!run_->read(m.data(), coeff)) {
+    return false;
+  }
+  std::vector<uint32_t> exponents(ring_->size());
+  for (size_t v = 0; v < exponents.size(); ++v) {
+    exponents[v] = Impl_::Polynomial::exponentOf(m.data(), v);
+  }
+  term = Expression(Impl_::simplify(ring_->toTerm(exponents, coeff)));
+  return true;
+}
+
+void Symbol::ExternalExpansion::rewind() {
+  run_->rewind();
+}
+
+Symbol::Expression Symbol::ExternalExpansion::toExpression() {
+  rewind();
+  Operands terms;
+  Expression term(0);
+  while (next(term)) {
+    terms.push_back(term.pExp_);
+  }
+  rewind();
+  return Expression(Impl_::simplify(Impl_::constructADD(terms)));
+}
+
+void Symbol::ExternalExpansion::write(std::ostream& o) {
+  rewind();
+  Expression term(0);
+  while (next(term)) {
+    o << term << std::endl;
+  }
+  rewind();
+}
+
+void Symbol::enableHashConsing(bool enable) {
+  Impl_::UniqueTable::instance().enable(enable);
+}
@@ -1,5 +1,7 @@
 #include "symbol.hpp"
 #include "gtest/gtest.h"
+#include <sstream>
+#include <cstring>
 
 INITIALIZE_EASYLOGGINGPP
 
@@ -489,3 +491,390 @@ TEST(Expression, Evaluate) {
 
   ASSERT_EQ((x - y).evaluate(), -2);
 }
+
+TEST(Expression, Context) {
+  Symbol::Context context(1024);
+
+  {
+    Symbol::Expression x("x", 2);
+    Symbol::Expression y("y", 3);
+    Symbol::Expression e = (x + y) * (x - y) + 2 * x;
+
+    ASSERT_EQ(e.evaluate(), -1);
+    ASSERT_EQ(e, (x ^ 2) - (y ^ 2) + 2 * x);
+    ASSERT_NE(0, context.live());
+    ASSERT_THROW(context.reset(), std::runtime_error);
+  }
+
+  ASSERT_NO_THROW(context.reset());
+  ASSERT_EQ(0, context.live());
+
+  Symbol::Expression z("z", 4);
+  ASSERT_EQ((z * z).evaluate(), 16);
+}
+
+TEST(Expression, FlatExpression) {
+  Symbol::Expression x("x", 2);
+  Symbol::Expression y("y", 3);
+  Symbol::Expression e = (x ^ 3) * y + log(x + y);
+
+  Symbol::FlatExpression flat(e);
+  std::stringstream expected;
+  expected << e;
+  ASSERT_EQ(flat.toStr(), expected.str());
+  ASSERT_NEAR(flat.evaluate(), e.evaluate(), 1e-9);
+  ASSERT_EQ(flat.toExpression(), e);
+
+  // Derivative agrees with the tree implementation
+  Symbol::Expression dx = e.differentiate(x);
+  Symbol::FlatExpression flatDx = flat.differentiate(x);
+  ASSERT_NEAR(flatDx.evaluate(), dx.evaluate(), 1e-9);
+  ASSERT_EQ(flatDx.toExpression(), dx);
+
+  std::stringstream ss;
+  flat.write(ss);
+  Symbol::FlatExpression read = Symbol::FlatExpression::read(ss);
+  ASSERT_EQ(read.size(), flat.size());
+  ASSERT_EQ(read.toExpression(), e);
+  ASSERT_EQ(read.assign("x", 1).evaluate(), 3 + std::log(4.0));
+
+  // Corrupt or truncated input throws instead of failing later.
+  auto data = ss.str();
+  auto corrupt = [&data](size_t offset, const void* bytes, size_t n) {
+    std::string copy = data;
+    std::memcpy(&copy[offset], bytes, n);
+    std::stringstream s(copy);
+    return Symbol::FlatExpression::read(s);
+  };
+  std::stringstream truncated(data.substr(0, data.size() - 2));
+  ASSERT_THROW(Symbol::FlatExpression::read(truncated), std::runtime_error);
+  uint32_t huge = 0xffffffff;
+  // Name length of the first symbol
+  ASSERT_THROW(corrupt(8, &huge, 4), std::runtime_error);
+  // Node count, then operator, symbol and operand range of the first node
+  size_t nodes = 8 + 4 + 1 + 4 + 1;
+  ASSERT_THROW(corrupt(nodes, &huge, 4), std::runtime_error);
+  uint8_t oprtr = 200;
+  ASSERT_THROW(corrupt(nodes + 4, &oprtr, 1), std::runtime_error);
+  ASSERT_THROW(corrupt(nodes + 5, &huge, 4), std::runtime_error);
+  ASSERT_THROW(corrupt(nodes + 9, &huge, 4), std::runtime_error);
+  // ADD and MULTIPLY need two operands. Records are 21 bytes long.
+  size_t sum = 0;
+  while (Symbol::Impl_::Operator::ADD != flat.nodes()[sum].operator_ &&
+         Symbol::Impl_::Operator::MULTIPLY != flat.nodes()[sum].operator_) {
+    ++sum;
+  }
+  uint32_t one = 1;
+  ASSERT_THROW(corrupt(nodes + 4 + 21 * sum + 9, &one, 4), std::runtime_error);
+  // Children count, then the first child index
+  auto children = data.size() - 4 * flat.children().size() - 4;
+  ASSERT_THROW(corrupt(children, &huge, 4), std::runtime_error);
+  ASSERT_THROW(corrupt(children + 4, &huge, 4), std::runtime_error);
+}
+
+TEST(Expression, InPlaceAddition) {
+  Symbol::Expression x("x", 2);
+  Symbol::Expression y("y", 3);
+  Symbol::Expression z("z", 5);
+
+  Symbol::Expression sum(1);
+  Symbol::Expression expected(1);
+  for (auto& term : {x * y, 2 * z, x ^ 2, 3 * x * y, -z, Symbol::Expression(4)}) {
+    sum += term;
+    expected = expected + term;
+  }
+  std::stringstream s1, s2;
+  s1 << sum;
+  s2 << expected;
+  ASSERT_EQ(s1.str(), s2.str());
+  ASSERT_EQ(sum, expected);
+  ASSERT_EQ(sum.evaluate(), expected.evaluate());
+
+  // Shared sums are not modified.
+  Symbol::Expression copy = sum;
+  sum += x;
+  ASSERT_EQ(copy, expected);
+  ASSERT_EQ(sum, expected + x);
+
+  sum -= x;
+  sum -= 4 * x * y;
+  sum -= z;
+  sum -= x ^ 2;
+  ASSERT_EQ(sum, 5);
+
+  Symbol::Expression chain = x + y + z - y;
+  ASSERT_EQ(chain, x + z);
+}
+
+TEST(Expression, InPlaceMultiplication) {
+  Symbol::Expression x("x", 2);
+  Symbol::Expression y("y", 3);
+  Symbol::Expression z("z", 5);
+
+  Symbol::Expression product = 3 * x;
+  Symbol::Expression expected = 3 * x;
+  for (auto& factor : {y, x ^ 2, 2 * z, x ^ 2, Symbol::Expression(-1), 1 / y}) {
+    product *= factor;
+    expected = expected * factor;
+  }
+  std::stringstream s1, s2;
+  s1 << product;
+  s2 << expected;
+  ASSERT_EQ(s1.str(), s2.str());
+  ASSERT_EQ(product, expected);
+  ASSERT_NEAR(product.evaluate(), expected.evaluate(), 1e-9);
+
+  // Shared products are not modified.
+  Symbol::Expression copy = product;
+  product *= z;
+  ASSERT_EQ(copy, expected);
+
+  product /= z;
+  product /= z;
+  product /= x;
+  product /= x;
+  ASSERT_EQ(product, -6 * (x ^ 3));
+
+  product *= x + 1;
+  ASSERT_EQ(product, -6 * (x ^ 4) - 6 * (x ^ 3));
+
+  Symbol::Expression chain = x * y * z / y;
+  ASSERT_EQ(chain, x * z);
+}
+
+TEST(Expression, PolynomialExpansion) {
+  Symbol::Expression x("x", 0.5);
+  Symbol::Expression y("y", 2);
+  Symbol::Expression z("z", 3);
+
+  Symbol::Expression p = (x + y + z + 1) ^ 6;
+  ASSERT_NEAR(std::pow(6.5, 6), p.evaluate(), 1e-6);
+  // Multinomial coefficients 6! / (i! j! k! (6 - i - j - k)!)
+  // summed term by term without expansion.
+  const double factorial[] = {1, 1, 2, 6, 24, 120, 720};
+  Symbol::Expression expected(0);
+  for (int i = 0; i <= 6; ++i) {
+    for (int j = 0; i + j <= 6; ++j) {
+      for (int k = 0; i + j + k <= 6; ++k) {
+        auto c = factorial[6] / (factorial[i] * factorial[j] * factorial[k] * factorial[6 - i - j - k]);
+        expected = expected + c * (x ^ i) * (y ^ j) * (z ^ k);
+      }
+    }
+  }
+  ASSERT_EQ(p, expected);
+
+  Symbol::Expression q = (x + log(y)) * (x - log(y));
+  ASSERT_EQ(q, (x ^ 2) - (log(y) ^ 2));
+}
+
+TEST(Expression, TermStream) {
+  Symbol::Expression x("x", 0.5);
+  Symbol::Expression y("y", 2);
+  Symbol::Expression z("z", 3);
+
+  // Terms are compared in order against the expansion multiplied in memory.
+  auto print = [](Symbol::Expression& term) {
+    std::stringstream s;
+    s << term;
+    return s.str();
+  };
+  auto expected = [&print](const std::vector<Symbol::Expression>& factors) {
+    Symbol::ExternalExpansion expansion(factors);
+    std::vector<std::string> terms;
+    Symbol::Expression term(0);
+    while (expansion.next(term)) {
+      terms.push_back(print(term));
+    }
+    return terms;
+  };
+
+  Symbol::TermStream product({x + y, x - y, z + 1});
+  Symbol::Expression term(0), sum(0);
+  std::vector<std::string> terms;
+  while (product.next(term)) {
+    terms.push_back(print(term));
+    sum += term;
+  }
+  ASSERT_EQ(4, terms.size());
+  ASSERT_EQ(expected({x + y, x - y, z + 1}), terms);
+  ASSERT_EQ(sum, (x + y) * (x - y) * (z + 1));
+
+  // (x + y + z + 1) ^ 20 has C(23, 3) terms.
+  Symbol::TermStream power(x + y + z + 1, 20);
+  size_t count = 0;
+  double value = 0;
+  while (power.next(term)) {
+    ++count;
+    value += term.evaluate();
+  }
+  ASSERT_EQ(1771, count);
+  ASSERT_NEAR(1, value / std::pow(6.5, 20), 1e-12);
+
+  Symbol::TermStream cube(x * y + y * z + 1, 3);
+  terms.clear();
+  while (cube.next(term)) {
+    terms.push_back(print(term));
+  }
+  ASSERT_EQ(10, terms.size());
+  ASSERT_EQ(expected({x * y + y * z + 1, x * y + y * z + 1, x * y + y * z + 1}), terms);
+}
+
+TEST(Expression, ExternalExpansion) {
+  Symbol::Expression x("x", 0.5);
+  Symbol::Expression y("y", 2);
+  Symbol::Expression z("z", 3);
+
+  // Partial products are spilled in runs of about 16 terms.
+  std::vector<Symbol::Expression> factors(6, x + y + z + 1);
+  factors.push_back(x - 1);
+  Symbol::ExternalExpansion expansion(factors, 16);
+  ASSERT_EQ(((x + y + z + 1) ^ 6) * (x - 1), expansion.toExpression());
+
+  size_t count = 0;
+  Symbol::Expression term(0);
+  while (expansion.next(term)) {
+    ++count;
+  }
+  ASSERT_EQ(expansion.size(), count);
+
+  std::stringstream s;
+  expansion.write(s);
+  std::string line;
+  count = 0;
+  while (std::getline(s, line)) {
+    ++count;
+  }
+  ASSERT_EQ(expansion.size(), count);
+
+  // One row per chunk spills the 252 terms of the fifth power
+  // to more runs than are merged at once.
+  Symbol::Expression a("a", 1), b("b", 2), c("c", 3), d("d", 4), e("e", 5);
+  std::vector<Symbol::Expression> many(6, a + b + c + d + e + 1);
+  Symbol::ExternalExpansion spilled(many, 6);
+  ASSERT_EQ(462, spilled.size());
+  ASSERT_EQ((a + b + c + d + e + 1) ^ 6, spilled.toExpression());
+}
+
+TEST(Expression, Budget) {
+  Symbol::Expression x("x", 0.5);
+  Symbol::Expression y("y", 2);
+  Symbol::Expression z("z", 3);
+
+  ASSERT_EQ(286, Symbol::Budget::predict(x + y + z + 1, 10));
+  ASSERT_EQ(10, Symbol::Budget::predict(x + y + z + 1, 2));
+  ASSERT_EQ(8, Symbol::Budget::predict({x + y, x + z, y + 1}));
+
+  {
+    // Expansions beyond 100 terms are left unexpanded.
+    Symbol::Budget budget(SIZE_MAX, 100);
+    Symbol::Expression small = (x + y + z + 1) ^ 3;
+    ASSERT_FALSE(budget.exceeded());
+    Symbol::Expression large = (x + y + z + 1) ^ 10;
+    ASSERT_TRUE(budget.exceeded());
+    ASSERT_EQ(large, "(1 + x + y + z) ^ 10");
+    ASSERT_NEAR(std::pow(6.5, 10), large.evaluate(), 1e-3);
+    ASSERT_NEAR(std::pow(6.5, 3), small.evaluate(), 1e-9);
+    // A refusal does not refuse the later expansions.
+    Symbol::Expression later = (x + y) * (x - y);
+    ASSERT_EQ(later, (x ^ 2) - (y ^ 2));
+  }
+
+  {
+    // The enclosing Budget still applies in a nested one.
+    Symbol::Budget outer(SIZE_MAX, 100);
+    {
+      Symbol::Budget inner;
+      Symbol::Expression large = (x + y + z + 1) ^ 10;
+      ASSERT_EQ(large, "(1 + x + y + z) ^ 10");
+      ASSERT_FALSE(inner.exceeded());
+      ASSERT_LE(inner.nodes(), outer.nodes());
+    }
+    ASSERT_TRUE(outer.exceeded());
+  }
+
+  {
+    Symbol::Budget budget(SIZE_MAX, 100, std::chrono::milliseconds::max(),
+                          Symbol::Budget::Mode::ABORT);
+    ASSERT_THROW((x + y + z + 1) ^ 10, std::runtime_error);
+  }
+
+  {
+    Symbol::Budget budget(4, SIZE_MAX, std::chrono::milliseconds::max(),
+                          Symbol::Budget::Mode::ABORT);
+    ASSERT_THROW((x + y) * (x + z) * (y + z + 2), std::runtime_error);
+    ASSERT_TRUE(budget.exceeded());
+  }
+
+  {
+    // An in-place update aborted midway leaves the target unchanged.
+    Symbol::Expression w("w", 13);
+    Symbol::Expression sum = x + y + z;
+    Symbol::Expression product = x * y * z;
+    Symbol::Expression addend = 2 * x + 4 * y + w;
+    Symbol::Expression factor = 3 * (x ^ 2) * (w ^ y) * y;
+    auto print = [](const Symbol::Expression& e) {
+      std::stringstream s;
+      s << e;
+      return s.str();
+    };
+    auto sumStr = print(sum), productStr = print(product);
+    {
+      Symbol::Budget budget(2, SIZE_MAX, std::chrono::milliseconds::max(),
+                            Symbol::Budget::Mode::ABORT);
+      ASSERT_THROW(sum += addend, std::runtime_error);
+      ASSERT_THROW(product *= factor, std::runtime_error);
+    }
+    ASSERT_EQ(sumStr, print(sum));
+    ASSERT_EQ(5.5, sum.evaluate());
+    ASSERT_EQ(productStr, print(product));
+    ASSERT_EQ(3, product.evaluate());
+    sum += addend;
+    ASSERT_EQ(sum, 3 * x + 5 * y + z + w);
+    ASSERT_EQ(27.5, sum.evaluate());
+    product *= factor;
+    ASSERT_EQ(product, 3 * (x ^ 3) * (y ^ 2) * z * (w ^ y));
+  }
+
+  {
+    Symbol::Budget budget(SIZE_MAX, SIZE_MAX, std::chrono::milliseconds(0));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    Symbol::Expression product = (x + y) * (x + z);
+    ASSERT_TRUE(budget.exceeded());
+    ASSERT_NEAR(2.5 * 3.5, product.evaluate(), 1e-9);
+  }
+
+  {
+    // An expansion in progress is stopped when the time runs out.
+    Symbol::Expression u("u", 1);
+    Symbol::Expression v("v", 1);
+    Symbol::Expression w("w", 1);
+    {
+      Symbol::Budget budget(SIZE_MAX, SIZE_MAX, std::chrono::milliseconds(10));
+      Symbol::Expression large = (u + v + w + x + y + z + 1) ^ 25;
+      ASSERT_TRUE(budget.exceeded());
+      ASSERT_EQ(large, "(1 + u + v + w + x + y + z) ^ 25");
+    }
+    {
+      Symbol::Budget budget(SIZE_MAX, SIZE_MAX, std::chrono::milliseconds(10),
+                            Symbol::Budget::Mode::ABORT);
+      ASSERT_THROW((u + v + w + x + y + z + 1) ^ 25, std::runtime_error);
+      ASSERT_TRUE(budget.exceeded());
+    }
+  }
+
+  {
+    // A result left unexpanded is simplified again after the scope.
+    Symbol::Expression square = 0;
+    {
+      Symbol::Budget budget(SIZE_MAX, 2);
+      square = (x + y) ^ 2;
+      ASSERT_TRUE(budget.exceeded());
+      ASSERT_EQ(square * 1, "(x + y) ^ 2");
+    }
+    ASSERT_EQ(square * 1, "(2 * x * y) + (y ^ 2) + (x ^ 2)");
+    ASSERT_EQ(square, (x ^ 2) + 2 * x * y + (y ^ 2));
+  }
+
+  // Without a Budget, the expansion is done.
+  ASSERT_EQ((x + y) * (x - y), (x ^ 2) - (y ^ 2));
+}
@@ -1,6 +1,7 @@
 #define TEST_IMPL_
 #include "symbol.hpp"
 #include "gtest/gtest.h"
+#include <unordered_set>
 
 INITIALIZE_EASYLOGGINGPP
 
@@ -31,11 +32,11 @@ TEST(Impl_, VariableConstruction) {
   auto v = constructVARIABLE("v");
   auto w = constructVARIABLE("w");
 
-  ASSERT_EQ("v", v->name_);
+  ASSERT_EQ("v", v->name());
   ASSERT_EQ("v", v->toStr());
   ASSERT_TRUE(std::isnan(w->value()));
 
-  ASSERT_EQ("w", w->name_);
+  ASSERT_EQ("w", w->name());
   ASSERT_EQ("w", w->toStr());
   ASSERT_TRUE(std::isnan(w->value()));
 }
@@ -45,19 +46,57 @@ TEST(Impl_, VariableConstructionWithInitialValue) {
   auto y = constructVARIABLE("y", 2);
   auto z = constructVARIABLE("z", 3);
 
-  ASSERT_EQ("x", x->name_);
+  ASSERT_EQ("x", x->name());
   ASSERT_EQ("x", x->toStr());
   ASSERT_EQ(1, x->value());
 
-  ASSERT_EQ("y", y->name_);
+  ASSERT_EQ("y", y->name());
   ASSERT_EQ("y", y->toStr());
   ASSERT_EQ(2, y->value());
 
-  ASSERT_EQ("z", z->name_);
+  ASSERT_EQ("z", z->name());
   ASSERT_EQ("z", z->toStr());
   ASSERT_EQ(3, z->value());
 }
 
+TEST(Impl_, VariableSymbolInterning) {
+  auto x1 = constructVARIABLE("x");
+  auto x2 = constructVARIABLE("x", 2);
+  auto y = constructVARIABLE("y");
+
+  ASSERT_EQ(x1->symbol_, x2->symbol_);
+  ASSERT_NE(x1->symbol_, y->symbol_);
+  ASSERT_EQ("x", SymbolTable::instance().name(x1->symbol_));
+  ASSERT_EQ(x1->symbol_, SymbolTable::instance().intern("x"));
+}
+
+TEST(Impl_, ConcurrentVariableConstruction) {
+  // Threads intern the same new names in different orders.
+  const size_t nThreads = 4, nNames = 200;
+  std::vector<std::vector<uint32_t>> symbols(nThreads);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nThreads; ++t) {
+    threads.emplace_back([&symbols, t, nNames]() {
+      symbols[t].resize(nNames);
+      for (size_t k = 0; k < nNames; ++k) {
+        auto i = t % 2 ? nNames - 1 - k : k;
+        auto v = constructVARIABLE("concurrent_" + std::to_string(i));
+        symbols[t][i] = v->symbol_;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < nNames; ++i) {
+    auto name = "concurrent_" + std::to_string(i);
+    for (size_t t = 0; t < nThreads; ++t) {
+      ASSERT_EQ(symbols[0][i], symbols[t][i]);
+    }
+    ASSERT_EQ(name, SymbolTable::instance().name(symbols[0][i]));
+  }
+}
+
 TEST(Impl_, NegationConstruction) {
   auto x = constructVARIABLE("x", 0);
   auto ten = constructCONST(10);
@@ -202,6 +241,437 @@ TEST(Impl_, PolynomialConstruction) {
   ASSERT_THROW(constructLOG(-one), std::runtime_error);
   ASSERT_NO_THROW(constructLOG(-x));
 }
+
+TEST(Impl_, ExpandProductWithSeveralFactors) {
+  auto x = constructVARIABLE("x", 2);
+  auto y = constructVARIABLE("y", 3);
+  auto z = constructVARIABLE("z", 5);
+
+  // Non-ADD factors form a single term: x * y * (x + 1) -> x * y * x + x * y
+  auto e = simplify(constructMULTIPLY({x, y, constructADD({x, constructOne()})}));
+  ASSERT_EQ(Operator::ADD, e->operator_);
+  ASSERT_EQ(2, e->operands_.size());
+  ASSERT_EQ(18, e->evaluate());
+
+  e = simplify(constructMULTIPLY({x, y, z, constructADD({y, z})}));
+  ASSERT_EQ(2, e->operands_.size());
+  ASSERT_EQ(240, e->evaluate());
+}
+TEST(Impl_, HashConsing) {
+  auto& table = UniqueTable::instance();
+  table.enable();
+
+  auto x = constructVARIABLE("x");
+  auto three = constructCONST(3);
+  auto powx3 = constructPOWER({x, constructCONST(3)});
+  auto logpowx3 = constructLOG(constructPOWER({x, three}));
+
+  ASSERT_EQ(three, constructCONST(3));
+  ASSERT_EQ(powx3, constructPOWER({x, three}));
+  ASSERT_EQ(powx3, logpowx3->operands_[0]);
+  ASSERT_NE(constructVARIABLE("x"), x);
+  ASSERT_NE(constructCONST(-3), three);
+
+  table.sweep();
+  auto sizeBefore = table.size();
+  {
+    auto tmp = constructADD({x, constructCONST(12345)});
+  }
+  table.sweep();
+  ASSERT_EQ(sizeBefore, table.size());
+
+  table.enable(false);
+  ASSERT_EQ(0, table.size());
+  auto large = constructCONST(12345);
+  ASSERT_NE(large, constructCONST(12345));
+}
+
+TEST(Impl_, ImmortalConstants) {
+  ASSERT_EQ(constructZero(), constructCONST(-0.0));
+  ASSERT_EQ(constructOne(), constructCONST(1));
+  ASSERT_EQ(constructCONST(-1), constructCONST(-1.0));
+  ASSERT_EQ(constructCONST(0.5), constructCONST(0.5));
+  ASSERT_NE(constructCONST(0.25), constructCONST(0.25));
+
+  Symbol::pExp two;
+  {
+    Symbol::Context context;
+    two = constructCONST(2);
+    ASSERT_EQ(0, context.live());
+  }
+  ASSERT_EQ(2, two->value());
+}
+
+TEST(Impl_, StructuralOrder) {
+  auto x1 = constructVARIABLE("x", 1);
+  auto x2 = constructVARIABLE("x", 2);
+  auto y = constructVARIABLE("y");
+  auto two = constructCONST(2);
+
+  ASSERT_EQ(0, compare(*x1, *x2));
+  ASSERT_EQ(x1->hash(), x2->hash());
+  ASSERT_LT(compare(*x1, *y), 0);
+  ASSERT_GT(compare(*y, *x1), 0);
+  ASSERT_LT(compare(*two, *x1), 0);
+  ASSERT_LT(compare(*constructCONST(-3), *two), 0);
+  ASSERT_LT(compare(*constructNEGATE(y), *x1), 0);
+
+  auto e1 = constructADD({constructMULTIPLY({two, x1}), constructLOG(y)});
+  auto e2 = constructADD({constructMULTIPLY({two, x2}), constructLOG(y)});
+  auto e3 = constructADD({constructMULTIPLY({two, y}), constructLOG(x1)});
+
+  ASSERT_EQ(e1->hash(), e2->hash());
+  ASSERT_EQ(0, compare(*e1, *e2));
+  ASSERT_NE(0, compare(*e1, *e3));
+  ASSERT_EQ(-compare(*e1, *e3), compare(*e3, *e1));
+}
+
+TEST(Impl_, UnchangedPassReturnsSameNode) {
+  auto x = constructVARIABLE("x");
+  auto y = constructVARIABLE("y");
+  auto addxy = constructADD({x, y});
+  auto addxyx = constructADD({addxy, x});
+
+  ASSERT_EQ(addxy, flatten(addxy));
+  ASSERT_NE(addxyx, flatten(addxyx));
+  ASSERT_EQ(addxy, merge(addxy));
+  ASSERT_NE(addxyx, merge(flatten(addxyx)));
+
+  auto e = simplify(addxyx);
+  ASSERT_TRUE(isSame(e, simplify(e)));
+  ASSERT_TRUE(isSame(e, simplify(constructADD({x, addxy}))));
+}
+
+TEST(Impl_, SimplifiedFlag) {
+  auto x = constructVARIABLE("x");
+  auto y = constructVARIABLE("y");
+  auto e = constructMULTIPLY({constructCONST(3), constructMULTIPLY({x, y})});
+
+  ASSERT_FALSE(e->isSimplified());
+
+  auto s = simplify(e);
+  ASSERT_TRUE(s->isSimplified());
+  ASSERT_EQ("3 * x * y", s->toStr());
+  ASSERT_EQ(s, simplify(s));
+
+  auto sum = simplify(constructADD({s, s}));
+  ASSERT_TRUE(sum->isSimplified());
+  ASSERT_EQ("6 * x * y", sum->toStr());
+}
+
+TEST(Impl_, SmallOperands) {
+  auto x = constructVARIABLE("x");
+  auto y = constructVARIABLE("y");
+  auto z = constructVARIABLE("z");
+
+  Symbol::Operands operands {x, y};
+  ASSERT_EQ(2, operands.capacity());
+
+  operands.push_back(z);
+  Symbol::Operands front {z, y};
+  operands.insert(operands.begin(), front.begin(), front.end());
+  ASSERT_EQ(5, operands.size());
+  ASSERT_EQ(z, operands[0]);
+  ASSERT_EQ(y, operands[1]);
+  ASSERT_EQ(x, operands[2]);
+  ASSERT_EQ(z, operands.back());
+
+  Symbol::Operands moved = std::move(operands);
+  ASSERT_EQ(5, moved.size());
+  ASSERT_EQ(0, operands.size());
+
+  auto negx = constructNEGATE(x);
+  ASSERT_EQ(1, negx->operands_.size());
+  ASSERT_EQ(2, negx->operands_.capacity());
+}
+
+TEST(Impl_, ReferenceCounting) {
+  auto x = constructVARIABLE("x");
+  ASSERT_EQ(1, x.use_count());
+  {
+    auto negx = constructNEGATE(x);
+    auto copy = negx;
+    ASSERT_EQ(2, x.use_count());
+    ASSERT_EQ(2, negx.use_count());
+  }
+  ASSERT_EQ(1, x.use_count());
+
+  Symbol::pExp moved = std::move(x);
+  ASSERT_FALSE(x);
+  ASSERT_EQ(1, moved.use_count());
+}
+
+TEST(Impl_, StructuralHash) {
+  auto x = constructVARIABLE("x");
+  auto y = constructVARIABLE("y");
+  auto e1 = constructMULTIPLY({constructCONST(2), constructPOWER({x, y})});
+  auto e2 = constructMULTIPLY({constructCONST(2), constructPOWER({x, y})});
+  auto e3 = constructMULTIPLY({constructCONST(2), constructPOWER({y, x})});
+
+  ASSERT_EQ(e1->hash(), Exp::structuralHash(Operator::MULTIPLY, NAN, 0, e1->operands_));
+  ASSERT_EQ(constructCONST(0.0)->hash(), constructCONST(-0.0)->hash());
+  ASSERT_NE(e1->hash(), e3->hash());
+
+  std::unordered_set<Symbol::pExp, hashOperand, equalOperand> terms {e1, e2, e3};
+  ASSERT_EQ(2, terms.size());
+  ASSERT_EQ(1, terms.count(e2));
+}
+
+TEST(Impl_, Decomposition) {
+  auto x = constructVARIABLE("x");
+  auto y = constructVARIABLE("y");
+  auto xy = constructMULTIPLY({x, y});
+
+  auto d2 = decompose2(constructNEGATE(constructMULTIPLY({constructCONST(3), x, y})));
+  ASSERT_EQ(-3, d2.coeff_);
+  ASSERT_EQ("x * y", d2.term_->toStr());
+  ASSERT_EQ(xy, decompose2(xy).term_);
+  ASSERT_EQ(x, decompose2(constructMULTIPLY({constructCONST(2), x})).term_);
+  ASSERT_FALSE(decompose2(constructCONST(5)).term_);
+
+  auto powx3 = constructPOWER({x, constructCONST(3)});
+  auto d3 = decompose3(powx3);
+  ASSERT_EQ(1, d3.coeff_);
+  ASSERT_EQ(x, d3.base_);
+  ASSERT_FALSE(d3.expo_);
+  ASSERT_EQ(3, d3.numericExpo_);
+
+  auto powxy = constructPOWER({x, y});
+  ASSERT_EQ(y, decompose3(powxy).expo_);
+  ASSERT_EQ(x, decompose3(powxy).base_);
+}
+
+TEST(Impl_, CoefficientField) {
+  auto x = constructVARIABLE("x", 2);
+  auto y = constructVARIABLE("y", 5);
+
+  auto product = simplify(constructMULTIPLY({constructCONST(3), x, constructCONST(2), y}));
+  ASSERT_EQ(Operator::MULTIPLY, product->operator_);
+  ASSERT_EQ(6, product->value_);
+  ASSERT_EQ(2, product->operands_.size());
+  ASSERT_EQ("6 * x * y", product->toStr());
+  ASSERT_EQ(60, product->evaluate());
+
+  auto sum = simplify(constructADD({constructCONST(1), x, constructCONST(2)}));
+  ASSERT_EQ(Operator::ADD, sum->operator_);
+  ASSERT_EQ(3, sum->value_);
+  ASSERT_EQ(1, sum->operands_.size());
+  ASSERT_EQ("3 + x", sum->toStr());
+
+  auto d = decompose2(product);
+  ASSERT_EQ(6, d.coeff_);
+  ASSERT_EQ(product, d.term_);
+
+  ASSERT_EQ("12 * x * y", simplify(constructADD({product, product}))->toStr());
+  ASSERT_TRUE(simplify(constructADD({product, constructNEGATE(product)}))->isZero());
+}
+
+TEST(Impl_, CanonicalOrderAfterInPlaceAppend) {
+  auto x = simplify(constructVARIABLE("x", 2));
+  auto y = simplify(constructVARIABLE("y", 3));
+  auto z = simplify(constructVARIABLE("z", 5));
+  auto isCanonical = [](const Symbol::pExp& e) {
+    return std::is_sorted(e->operands_.begin(), e->operands_.end(), compareOperands());
+  };
+
+  // Operands are kept in order as they are appended, not when read.
+  auto sum = simplify(constructADD({z, constructCONST(1)}));
+  ASSERT_TRUE(appendTerms(sum, y));
+  ASSERT_TRUE(appendTerms(sum, x));
+  ASSERT_TRUE(isCanonical(sum));
+  auto expected = simplify(constructADD({x, y, z, constructCONST(1)}));
+  ASSERT_EQ(expected->toStr(), sum->toStr());
+  ASSERT_TRUE(isSame(expected, sum));
+
+  // A new coefficient moves the term.
+  ASSERT_TRUE(appendTerms(sum, x));
+  ASSERT_TRUE(isCanonical(sum));
+  expected = simplify(constructADD({x, x, y, z, constructCONST(1)}));
+  ASSERT_EQ(expected->toStr(), sum->toStr());
+  ASSERT_TRUE(isSame(expected, sum));
+}
+
+TEST(Impl_, SparsePolynomial) {
+  auto x = Polynomial::variable(3, 0);
+  auto y = Polynomial::variable(3, 1);
+  auto z = Polynomial::variable(3, 2);
+  auto one = Polynomial::constant(3, 1);
+
+  auto p = (x + y * 2.0 + one) * (x + y * -2.0 + one);
+  // x^2 + 2 x - 4 y^2 + 1
+  ASSERT_EQ(4, p.size());
+  ASSERT_EQ(2, p.exponent(0, 0));
+  ASSERT_EQ(1, p.coefficient(0));
+  ASSERT_EQ(1, p.exponent(1, 0));
+  ASSERT_EQ(2, p.coefficient(1));
+  ASSERT_EQ(2, p.exponent(2, 1));
+  ASSERT_EQ(-4, p.coefficient(2));
+  ASSERT_EQ(1, p.coefficient(3));
+
+  // (x + y + z + 1) ^ n has C(n + 3, 3) terms.
+  auto q = (x + y + z + one).pow(10);
+  ASSERT_EQ(286, q.size());
+  ASSERT_EQ(10, q.degree());
+  ASSERT_EQ(0, (q + q * -1.0).size());
+
+  // Cancelled products are dropped as they are combined.
+  auto r = (x + y * -1.0) * (x + y) * (x * x + y * y);
+  ASSERT_EQ(2, r.size());
+  ASSERT_EQ(4, r.exponent(0, 0));
+  ASSERT_EQ(4, r.exponent(1, 1));
+  ASSERT_EQ(-1, r.coefficient(1));
+}
+
+TEST(Impl_, ParallelPolynomialMultiplication) {
+  auto x = Polynomial::variable(4, 0);
+  auto y = Polynomial::variable(4, 1);
+  auto z = Polynomial::variable(4, 2);
+  auto w = Polynomial::variable(4, 3);
+  auto p = (x + y * 2.0 + z * -1.0 + w + Polynomial::constant(4, 1)).pow(8);
+  auto q = (x * -1.0 + y + z * 3.0 + w * w).pow(6);
+
+  auto threads = Polynomial::threads();
+  Polynomial::setThreads(1);
+  auto sequential = p * q;
+  Polynomial::setThreads(4);
+  auto parallel = p * q;
+  Polynomial::setThreads(threads);
+
+  ASSERT_EQ(sequential.size(), parallel.size());
+  for (size_t i = 0; i < sequential.size(); ++i) {
+    ASSERT_EQ(sequential.coefficient(i), parallel.coefficient(i));
+    for (size_t v = 0; v < 4; ++v) {
+      ASSERT_EQ(sequential.exponent(i, v), parallel.exponent(i, v));
+    }
+  }
+}
+
+TEST(Impl_, WorkerPool) {
+  auto& pool = WorkerPool::instance();
+  // Nested runs are served by the same threads without deadlock.
+  std::vector<std::atomic<int>> counts(8);
+  std::vector<std::function<void()>> outer;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    outer.push_back([&pool, &counts, i]() {
+      std::vector<std::function<void()>> inner;
+      for (size_t j = 0; j < 8; ++j) {
+        inner.push_back([&counts, i]() { ++counts[i]; });
+      }
+      pool.run(inner, 4);
+    });
+  }
+  pool.run(outer, 4);
+  for (auto& count : counts) {
+    ASSERT_EQ(8, count.load());
+  }
+
+  // An exception is rethrown after every task finished.
+  std::atomic<int> finished(0);
+  std::vector<std::function<void()>> tasks;
+  for (size_t i = 0; i < 8; ++i) {
+    tasks.push_back([&finished, i]() {
+      ++finished;
+      if (3 == i) {
+        throw std::runtime_error("task failed");
+      }
+    });
+  }
+  ASSERT_THROW(pool.run(tasks, 4), std::runtime_error);
+  ASSERT_EQ(8, finished.load());
+}
+
+TEST(Impl_, MultinomialPower) {
+  auto x = Polynomial::variable(3, 0);
+  auto y = Polynomial::variable(3, 1);
+  auto z = Polynomial::variable(3, 2);
+  auto one = Polynomial::constant(3, 1);
+
+  // Disjoint terms are expanded by the multinomial theorem,
+  // the others by repeated squaring.
+  for (auto base : {x + y * 2.0 + z * z * -0.5 + one * 3.0, x * y + y * z + one}) {
+    auto p = base.pow(7);
+    auto q = base * base * base * base * base * base * base;
+    ASSERT_EQ(q.size(), p.size());
+    for (size_t i = 0; i < p.size(); ++i) {
+      ASSERT_NEAR(q.coefficient(i), p.coefficient(i), 1e-6 * std::fabs(q.coefficient(i)));
+      for (size_t v = 0; v < 3; ++v) {
+        ASSERT_EQ(q.exponent(i, v), p.exponent(i, v));
+      }
+    }
+  }
+  ASSERT_EQ(1, (x + y).pow(0).size());
+  ASSERT_EQ(0, Polynomial(3).pow(2).size());
+}
+
+TEST(Impl_, PolynomialStream) {
+  auto x = Polynomial::variable(3, 0);
+  auto y = Polynomial::variable(3, 1);
+  auto z = Polynomial::variable(3, 2);
+  auto one = Polynomial::constant(3, 1);
+
+  // (x + y) * (x - y) * (z + 1) in the order of monomials
+  PolynomialStream product({x + y, x + y * -1.0, z + one});
+  const uint32_t exponents[][3] = {{2, 0, 1}, {2, 0, 0}, {0, 2, 1}, {0, 2, 0}};
+  const double coeffs[] = {1, 1, -1, -1};
+  for (size_t i = 0; i < 4; ++i) {
+    ASSERT_TRUE(product.next());
+    ASSERT_EQ(coeffs[i], product.coefficient());
+    for (size_t v = 0; v < 3; ++v) {
+      ASSERT_EQ(exponents[i][v], product.exponent(v));
+    }
+  }
+  ASSERT_FALSE(product.next());
+
+  // Streams agree with the multiplied polynomials term by term.
+  auto a = x * 2.0 + y * y + z * -1.0 + one;
+  auto b = x * y + y * z * 3.0 + one;
+  auto check = [](const Polynomial& expected, PolynomialStream& stream) {
+    for (size_t i = 0; i < expected.size(); ++i) {
+      ASSERT_TRUE(stream.next());
+      ASSERT_NEAR(expected.coefficient(i), stream.coefficient(), 1e-9 * std::fabs(expected.coefficient(i)));
+      for (size_t v = 0; v < 3; ++v) {
+        ASSERT_EQ(expected.exponent(i, v), stream.exponent(v));
+      }
+    }
+    ASSERT_FALSE(stream.next());
+  };
+  PolynomialStream factors({a, b, a, b * -2.0, a});
+  check(a * b * a * (b * -2.0) * a, factors);
+  // Terms of b are not disjoint, so the power is not multinomial.
+  PolynomialStream power(b, 7);
+  check(b * b * b * b * b * b * b, power);
+  PolynomialStream zeroth(b, 0);
+  check(one, zeroth);
+}
+
+TEST(Impl_, DenseUnivariatePolynomial) {
+  auto x = Polynomial::variable(1, 0);
+  auto one = Polynomial::constant(1, 1);
+
+  // q = x ^ 99 + ... + 1 is multiplied by Karatsuba.
+  auto q = Polynomial::constant(1, 0);
+  auto power = one;
+  for (size_t k = 0; k < 100; ++k) {
+    q = q + power;
+    power = power * x;
+  }
+  auto r = q * q;
+  ASSERT_EQ(199, r.size());
+  for (size_t k = 0; k < 199; ++k) {
+    ASSERT_EQ(198 - k, r.exponent(k, 0));
+    ASSERT_EQ(std::min(k + 1, 199 - k), r.coefficient(k));
+  }
+
+  // Coefficients of (x + 1) ^ 100 are too wide for Karatsuba to be accurate.
+  auto p = (x + one).pow(100);
+  ASSERT_EQ(101, p.size());
+  double binomial = 1;
+  for (size_t k = 0; k <= 100; ++k) {
+    ASSERT_NEAR(1, p.coefficient(k) / binomial, 1e-12);
+    binomial = binomial * (100 - k) / (k + 1);
+  }
+}
+
 /*
 TEST(Data, Initialization) {
   ASSERT_THROW(Tensor(0.0, Type::NONE), std::runtime_error);